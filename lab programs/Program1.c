@@ -1,25 +1,55 @@
 #include<stdio.h>
 #include<stdlib.h>
+#include<stdint.h>
 #include<omp.h>
 #define SEED 50123
+#define BATCH 8
+
+/* Counter-based generator: the i-th random number of a run is the SplitMix64
+   finalizer applied to SEED-derived key + i. Threads share no state, and
+   sample i draws the same point whatever the thread count. */
+static inline uint64_t mix64(uint64_t z){
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Top 53 bits to a double in [0,1) */
+static inline double to_unit(uint64_t u){
+	return (double)(u >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Fill x[], y[] with BATCH points starting at sample 'first'. The loop is
+   branch-free lane arithmetic, so it vectorizes to SIMD-width batches. */
+static inline void uniform_batch(uint64_t key, long first, double x[BATCH], double y[BATCH]){
+	#pragma omp simd
+	for(int l=0; l<BATCH; l++){
+		uint64_t c = key + 2 * (uint64_t)(first + l);
+		x[l] = to_unit(mix64(c));
+		y[l] = to_unit(mix64(c + 1));
+	}
+}
 
 int main()
 {
 	long n = 0, i, count = 0;
-	double x,y,z;
-	srand(SEED);
+	uint64_t key = mix64((uint64_t)SEED);
 	printf("Size\t\tT1\t\t\tT2\t\t\tT4\t\t\tT8");
 	for(n=100; n<=1000000; n*=10){
 		printf("\n%ld\t",n);
 		for(int t=1; t<=8; t*=2){
 			count = 0;
 			double start = omp_get_wtime();
-			#pragma omp parallel for private(x, y, z) reduction(+:count) num_threads(t)
-			for ( i=0; i<n; i++){
-				x = (double)rand()/RAND_MAX;
-				y = (double)rand()/RAND_MAX;
-				z = x*x+y*y;
-				if (z<=1) count++;
+			#pragma omp parallel for reduction(+:count) num_threads(t) schedule(static)
+			for ( i=0; i<n; i+=BATCH){
+				double x[BATCH], y[BATCH];
+				long hits = 0;
+				int m = n - i < BATCH ? (int)(n - i) : BATCH;
+				uniform_batch(key, i, x, y);
+				#pragma omp simd reduction(+:hits)
+				for(int l=0; l<m; l++)
+					hits += x[l]*x[l] + y[l]*y[l] <= 1.0;
+				count += hits;
 			}
 			double pi=(double)count/n * 4;
 			double stop = omp_get_wtime();
@@ -29,4 +59,3 @@ int main()
 	printf("\n");
 	return 0;
 }
-
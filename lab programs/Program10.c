@@ -1,9 +1,78 @@
 #include <sys/time.h>
 #include<stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #define MAX 1000
+#define TILE 32
+#if !defined(_OPENACC) && !defined(_OPENMP)
+#error "Build with OpenACC (-acc) and/or OpenMP (-mp, -fopenmp)"
+#endif
 int SIZE;
 double **a,**b,**c,**d;
+
+double wtime(void){
+  struct timeval tim;
+  gettimeofday(&tim, NULL);
+  return tim.tv_sec+(tim.tv_usec/1000000.0);
+}
+
+#ifdef _OPENACC
+/* OpenACC backend (pgcc -acc -ta=multicore) */
+void matmul_acc(void){
+  int i,j,k;
+  double tmp;
+#pragma acc data copyin(a[0:SIZE][0:SIZE],b[0:SIZE][0:SIZE]) copy(c[0:SIZE][0:SIZE])
+#pragma acc kernels
+#pragma acc loop tile(32,32)
+  for (i = 0; i < SIZE; ++i) {
+    for (j = 0; j < SIZE; ++j) {
+      tmp=0.0f;
+#pragma acc loop reduction(+:tmp)
+      for (k = 0; k < SIZE; ++k) {
+        tmp += a[i][k] * b[k][j];
+      }
+      c[i][j] = tmp;
+    }
+  }
+}
+#endif
+
+#ifdef _OPENMP
+/* OpenMP CPU backend with the same 32x32 tiling: threads take whole
+   tiles of c, and the k loop is a SIMD reduction as in the OpenACC loop */
+void matmul_omp(void){
+  int ii,jj;
+#pragma omp parallel for collapse(2) schedule(static)
+  for (ii = 0; ii < SIZE; ii += TILE) {
+    for (jj = 0; jj < SIZE; jj += TILE) {
+      int i,j,k;
+      for (i = ii; i < ii + TILE && i < SIZE; ++i) {
+        for (j = jj; j < jj + TILE && j < SIZE; ++j) {
+          double tmp=0.0f;
+#pragma omp simd reduction(+:tmp)
+          for (k = 0; k < SIZE; ++k) {
+            tmp += a[i][k] * b[k][j];
+          }
+          c[i][j] = tmp;
+        }
+      }
+    }
+  }
+}
+#endif
+
+/* Check a backend's result matrix against the serial one */
+void check(const char *backend){
+  int i,j;
+  for (i = 0; i < SIZE; ++i)
+    for (j = 0; j < SIZE; ++j)
+      if(c[i][j] != d[i][j]) {
+	printf("Error %d %d %f %f \n", i,j, c[i][j], d[i][j]);
+	exit(1);
+      }
+  printf("%s matrix multiplication test was successful!\n", backend);
+}
+
 int main(int argc, char* argv[]){
   SIZE=atoi(argv[1]);
   a = (double**)malloc(SIZE*sizeof (double*));
@@ -11,11 +80,10 @@ int main(int argc, char* argv[]){
   c = (double**)malloc(SIZE*sizeof (double*));
   d = (double**)malloc(SIZE*sizeof (double*));
   int i,j,k;
-  struct timeval tim;
   double t1, t2, tmp;
 
   /* Initialize matrices.*/
-  
+
   for (i = 0; i < SIZE; ++i) {
   	a[i] = (double*)malloc(SIZE*sizeof(double));  b[i] = (double*)malloc(SIZE*sizeof(double));
   	c[i] = (double*)malloc(SIZE*sizeof(double));  d[i] = (double*)malloc(SIZE*sizeof(double));
@@ -35,38 +103,23 @@ int main(int argc, char* argv[]){
       d[i][j] = tmp;
     }
   }
-  /*Time stamp t1*/
-  
-  gettimeofday(&tim, NULL);
-  t1=tim.tv_sec+(tim.tv_usec/1000000.0);
-  /* Compute matrix multiplication.*/
-  
-#pragma acc data copyin(a[0:SIZE][0:SIZE],b[0:SIZE][0:SIZE]) copy(c[0:SIZE][0:SIZE])
-#pragma acc kernels
-#pragma acc loop tile(32,32)
-  for (i = 0; i < SIZE; ++i) {
-    for (j = 0; j < SIZE; ++j) {
-      tmp=0.0f;
-#pragma acc loop reduction(+:tmp)
-      for (k = 0; k < SIZE; ++k) {
-        tmp += a[i][k] * b[k][j];
-      }
-      c[i][j] = tmp;
-    }
-  }
-  /* Time stamp t2, elapsed time OpenACC*/
-  
-  gettimeofday(&tim, NULL);
-  t2=tim.tv_sec+(tim.tv_usec/1000000.0);
+  /* Run every backend compiled in, timings side by side */
+
+#ifdef _OPENACC
+  t1 = wtime();
+  matmul_acc();
+  t2 = wtime();
   printf("%.6lf seconds with OpenACC \n", t2-t1);
-  /* Check the OpenACC result matrix*/
-  
+  check("OpenACC");
+#endif
+#ifdef _OPENMP
   for (i = 0; i < SIZE; ++i)
-    for (j = 0; j < SIZE; ++j)
-      if(c[i][j] != d[i][j]) {
-	printf("Error %d %d %f %f \n", i,j, c[i][j], d[i][j]);
-	exit(1);
-      }
-  printf("OpenACC matrix multiplication test was successful!\n");
+    memset(c[i], 0, SIZE*sizeof(double));
+  t1 = wtime();
+  matmul_omp();
+  t2 = wtime();
+  printf("%.6lf seconds with OpenMP \n", t2-t1);
+  check("OpenMP");
+#endif
   return 0;
 }
@@ -1,26 +1,40 @@
 #include <math.h>
 #include <string.h>
+#ifdef _OPENACC
 #include <openacc.h>
+#endif
 #include <sys/time.h>
 #include<stdio.h>
 #define NN 1024
 #define NM 1024
+#if !defined(_OPENACC) && !defined(_OPENMP)
+#error "Build with OpenACC (-acc) and/or OpenMP (-mp, -fopenmp)"
+#endif
 float A[NN][NM], Anew[NN][NM];
-int main(int argc, char** argv){
-    int i,j;
-    const int n = NN, m = NM, iter_max = 1000;
-    const double tol = 1.0e-6;
-    double error = 1.0,t1, t2;
+const int n = NN, m = NM, iter_max = 1000;
+const double tol = 1.0e-6;
+
+double wtime(void){
     struct timeval tim;
+    gettimeofday(&tim, NULL);
+    return tim.tv_sec+(tim.tv_usec/1000000.0);
+}
+
+void init(void){
+    int j;
     memset(A, 0, n * m * sizeof(float));
     memset(Anew, 0, n * m * sizeof(float));
     for (j = 0; j < n; j++){
         A[j][0]    = 1.0;
         Anew[j][0] = 1.0;
     }
-    printf("Jacobi relaxation Calculation: %d x %d mesh\n", n, m);
-	gettimeofday(&tim, NULL);
-  	t1=tim.tv_sec+(tim.tv_usec/1000000.0);
+}
+
+#ifdef _OPENACC
+/* OpenACC backend (pgcc -acc -ta=multicore) */
+int jacobi_acc(double *err){
+    int i,j;
+    double error = 1.0;
     int iter = 0;
 #pragma acc data copy(A[0:NN][0:NM]) create (Anew[0:NN][0:NM])
     while ( error > tol && iter < iter_max ){
@@ -43,8 +57,62 @@ int main(int argc, char** argv){
 
         iter++;
     }
-    gettimeofday(&tim, NULL);
-  	t2=tim.tv_sec+(tim.tv_usec/1000000.0);
-    printf(" total: %f s\n", t2-t1);
+    *err = error;
+    return iter;
+}
+#endif
+
+#ifdef _OPENMP
+/* OpenMP CPU backend: the same two sweeps, rows split across threads,
+   with a max reduction for the residual */
+int jacobi_omp(double *err){
+    int i,j;
+    double error = 1.0;
+    int iter = 0;
+    while ( error > tol && iter < iter_max ){
+        error = 0.0;
+#pragma omp parallel for private(i) reduction(max:error)
+        for( j = 1; j < n-1; j++){
+#pragma omp simd reduction(max:error)
+            for( i = 1; i < m-1; i++ ){
+                Anew[j][i] = 0.25 * ( A[j][i+1] + A[j][i-1]
+                                + A[j-1][i] + A[j+1][i]);
+                error = fmax( error, fabs(Anew[j][i] - A[j][i]));
+            }
+        }
+#pragma omp parallel for private(i)
+        for( j = 1; j < n-1; j++){
+            for( i = 1; i < m-1; i++ ){
+                 A[j][i] = Anew[j][i];
+            }
+        }
+            if(iter % 100 == 0) printf("%5d, %0.6f\n", iter, error);
+
+        iter++;
+    }
+    *err = error;
+    return iter;
+}
+#endif
+
+int main(int argc, char** argv){
+    double error, t1, t2;
+    int iter;
+    printf("Jacobi relaxation Calculation: %d x %d mesh\n", n, m);
+    /* Run every backend compiled in, timings side by side */
+#ifdef _OPENACC
+    init();
+    t1 = wtime();
+    iter = jacobi_acc(&error);
+    t2 = wtime();
+    printf(" OpenACC total: %f s, %d iterations, error %0.6f\n", t2-t1, iter, error);
+#endif
+#ifdef _OPENMP
+    init();
+    t1 = wtime();
+    iter = jacobi_omp(&error);
+    t2 = wtime();
+    printf(" OpenMP total: %f s, %d iterations, error %0.6f\n", t2-t1, iter, error);
+#endif
     return 0;
 }
@@ -1,34 +1,90 @@
 #include<stdio.h>
+#include<stdint.h>
+#include<math.h>
 #include<mpi.h>
+#include<omp.h>
 #include<stdlib.h>
 #define SEED 3655942
+#define BATCH 8
+
+/* Counter-based generator, as in Program1.c: random number c of the run is
+   the SplitMix64 finalizer of key + c, so ranks and threads need no state */
+static inline uint64_t mix64(uint64_t z){
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline double to_unit(uint64_t u){
+	return (double)(u >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Hits inside the quarter circle among samples [first, first+n), OpenMP
+   threads over SIMD-width batches */
+long long count_hits(uint64_t key, long long first, long n){
+	long long hits = 0;
+	long i;
+	#pragma omp parallel for reduction(+:hits) schedule(static)
+	for(i=0; i<n; i+=BATCH){
+		int m = n - i < BATCH ? (int)(n - i) : BATCH;
+		long h = 0;
+		#pragma omp simd reduction(+:h)
+		for(int l=0; l<m; l++){
+			uint64_t c = key + 2 * (uint64_t)(first + i + l);
+			double x = to_unit(mix64(c)), y = to_unit(mix64(c + 1));
+			h += x*x + y*y <= 1.0;
+		}
+		hits += h;
+	}
+	return hits;
+}
 
 int main(int argc, char **argv){
-	int iter = 10000;
-	int i, reduced_count,reduced_iter, count = 0;
-	int rank;
-	double pi,x,y,z,t;
-	MPI_Init(&argc,&argv);
+	double tol = argc > 1 ? atof(argv[1]) : 1e-4;
+	long batch = argc > 2 ? atol(argv[2]) : 1000000;
+	int rank, nprocs, provided, done = 0;
+	long rounds = 0;
+	long long local[2] = {0, 0}, sent[2], global[2] = {0, 0};
+	double pi = 0.0, err = 0.0, t;
+	uint64_t key = mix64((uint64_t)SEED);
+	MPI_Request req = MPI_REQUEST_NULL;
+	MPI_Init_thread(&argc,&argv,MPI_THREAD_FUNNELED,&provided);
 	MPI_Comm_rank(MPI_COMM_WORLD,&rank);
-	if(rank==0){
-		t = MPI_Wtime();
+	MPI_Comm_size(MPI_COMM_WORLD,&nprocs);
+	if(tol <= 0 || batch < 1){
+		if(rank==0)
+			printf("Usage: %s [tolerance>0] [samples-per-rank-per-round>0]\n",argv[0]);
+		MPI_Finalize();
+		return 1;
 	}
-	if(rank>0){
-		srand(SEED+rank*10);
-		for(i=0;i<iter;i++){
-			x = (double)rand()/RAND_MAX;
-			y = (double)rand()/RAND_MAX;
-			z = x*x + y*y;
-			if(z<=1) count++;
+	t = MPI_Wtime();
+	/* Every rank, rank 0 included, samples in rounds. The totals of round r
+	   are summed with a non-blocking allreduce while round r+1 runs; every
+	   rank sees the same sums, so all stop on the same round once the
+	   standard error of the estimate is below tol. */
+	while(!done){
+		long long first = (rounds * nprocs + rank) * (long long)batch;
+		local[0] += count_hits(key, first, batch);
+		local[1] += batch;
+		rounds++;
+		if(req != MPI_REQUEST_NULL){
+			MPI_Wait(&req, MPI_STATUS_IGNORE);
+			double p = (double)global[0] / (double)global[1];
+			pi = 4 * p;
+			err = 4 * sqrt(p * (1 - p) / (double)global[1]);
+			if(global[0] > 0 && err < tol)
+				done = 1;
+		}
+		if(!done){
+			sent[0] = local[0];
+			sent[1] = local[1];
+			MPI_Iallreduce(sent, global, 2, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD, &req);
 		}
 	}
-	MPI_Reduce(&count,&reduced_count,1,MPI_INT,MPI_SUM,0,MPI_COMM_WORLD);
-	MPI_Reduce(&iter,&reduced_iter,1,MPI_INT,MPI_SUM,0,MPI_COMM_WORLD);
-	reduced_iter = reduced_iter - iter;
 	if(rank==0){
 		t = MPI_Wtime() - t;
-		pi = (double)reduced_count/(double)reduced_iter * 4;
-		printf("pi : %lf time: %lf\n",pi,t);
+		printf("pi : %lf +- %lf samples: %lld rounds: %ld threads/rank: %d time: %lf\n",
+			pi, err, global[1], rounds, omp_get_max_threads(), t);
 	}
 	MPI_Finalize();
 	return 0;
@@ -0,0 +1,204 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<string.h>
+#include<math.h>
+#include<mpi.h>
+#include<omp.h>
+#define SEED 3655942
+#define MAXDIM 10
+#define BITS 32
+
+typedef double (*integrand_t)(const double *x, int d);
+
+/* Sobol direction numbers V[j][k] for dimension j, bit k */
+unsigned int V[MAXDIM][BITS];
+
+/* Joe-Kuo primitive polynomials (degree s, coefficients a) and initial
+   m values for dimensions 2..MAXDIM; dimension 1 is the van der Corput
+   sequence */
+const int poly_s[MAXDIM] = {0, 1, 2, 3, 3, 4, 4, 5, 5, 5};
+const int poly_a[MAXDIM] = {0, 0, 1, 1, 2, 1, 4, 2, 4, 7};
+const int poly_m[MAXDIM][5] = {{0}, {1}, {1,3}, {1,3,1}, {1,1,1}, {1,1,3,3},
+	{1,3,5,13}, {1,1,5,5,17}, {1,1,5,5,5}, {1,1,7,11,19}};
+
+void sobol_init(){
+	for(int k=0; k<BITS; k++)
+		V[0][k] = 1u << (BITS - 1 - k);
+	for(int j=1; j<MAXDIM; j++){
+		int s = poly_s[j], a = poly_a[j];
+		for(int k=0; k<BITS; k++){
+			if(k < s){
+				V[j][k] = (unsigned int)poly_m[j][k] << (BITS - 1 - k);
+				continue;
+			}
+			unsigned int v = V[j][k-s] ^ (V[j][k-s] >> s);
+			for(int i=1; i<s; i++)
+				if((a >> (s - 1 - i)) & 1)
+					v ^= V[j][k-i];
+			V[j][k] = v;
+		}
+	}
+}
+
+/* Skip-ahead: point n of the Gray-code ordered sequence, computed directly */
+void sobol_point(uint64_t n, int d, unsigned int *x){
+	uint64_t g = n ^ (n >> 1);
+	for(int j=0; j<d; j++){
+		unsigned int v = 0;
+		for(int k=0; g >> k; k++)
+			if((g >> k) & 1)
+				v ^= V[j][k];
+		x[j] = v;
+	}
+}
+
+/* Counter-based pseudo-random numbers for the plain Monte Carlo baseline */
+static inline uint64_t mix64(uint64_t z){
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Integrands over the unit hypercube, with their exact values */
+double f_pi(const double *x, int d){
+	(void)d;
+	return 4.0 * (x[0]*x[0] + x[1]*x[1] <= 1.0);
+}
+double f_gauss(const double *x, int d){
+	double s = 0;
+	for(int j=0; j<d; j++)
+		s += x[j]*x[j];
+	return exp(-s);
+}
+/* Sobol' g-function with a_j = j */
+double f_gfun(const double *x, int d){
+	double p = 1;
+	for(int j=0; j<d; j++)
+		p *= (fabs(4*x[j] - 2) + j) / (1.0 + j);
+	return p;
+}
+double exact_value(const char *name, int d){
+	if(strcmp(name, "pi") == 0)
+		return M_PI;
+	if(strcmp(name, "gauss") == 0)
+		return pow(sqrt(M_PI) / 2 * erf(1.0), d);
+	return 1.0;
+}
+
+/* Sum of f over QMC points [first, first+count), digitally shifted by
+   shift[]. Each thread takes a contiguous slice: it jumps to the slice
+   start with sobol_point, then walks it with the Gray-code update that
+   flips one direction number per dimension. */
+double qmc_sum(integrand_t f, int d, uint64_t first, uint64_t count, const unsigned int *shift){
+	double sum = 0;
+	#pragma omp parallel reduction(+:sum)
+	{
+		int nt = omp_get_num_threads(), id = omp_get_thread_num();
+		uint64_t lo = first + count * id / nt, hi = first + count * (id + 1) / nt;
+		unsigned int x[MAXDIM];
+		double u[MAXDIM];
+		if(lo < hi)
+			sobol_point(lo, d, x);
+		for(uint64_t n=lo; n<hi; n++){
+			for(int j=0; j<d; j++)
+				u[j] = ((x[j] ^ shift[j]) + 0.5) * (1.0 / 4294967296.0);
+			sum += f(u, d);
+			/* No step past the last point: after n = 2^BITS - 1 the flipped
+			   bit would index past V[j][BITS - 1] */
+			if(n + 1 == hi)
+				break;
+			int c = __builtin_ctzll(~n);
+			for(int j=0; j<d; j++)
+				x[j] ^= V[j][c];
+		}
+	}
+	return sum;
+}
+
+/* Same sum over pseudo-random points, for comparison */
+double mc_sum(integrand_t f, int d, uint64_t first, uint64_t count, uint64_t key){
+	double sum = 0;
+	#pragma omp parallel reduction(+:sum)
+	{
+		int nt = omp_get_num_threads(), id = omp_get_thread_num();
+		uint64_t lo = first + count * id / nt, hi = first + count * (id + 1) / nt;
+		double u[MAXDIM];
+		for(uint64_t n=lo; n<hi; n++){
+			for(int j=0; j<d; j++)
+				u[j] = (mix64(key + n * MAXDIM + j) >> 11) * (1.0 / 9007199254740992.0);
+			sum += f(u, d);
+		}
+	}
+	return sum;
+}
+
+/* Mean and standard error over replicates */
+void replicate_stats(const double *est, int r, double *mean, double *err){
+	double m = 0, v = 0;
+	for(int i=0; i<r; i++)
+		m += est[i];
+	m /= r;
+	for(int i=0; i<r; i++)
+		v += (est[i] - m) * (est[i] - m);
+	*mean = m;
+	*err = r > 1 ? sqrt(v / (r - 1) / r) : 0;
+}
+
+int main(int argc, char **argv){
+	const char *name = argc > 1 ? argv[1] : "gauss";
+	int d = argc > 2 ? atoi(argv[2]) : 6;
+	uint64_t max_n = argc > 3 ? strtoull(argv[3], NULL, 10) : (1ULL << 22);
+	int r = argc > 4 ? atoi(argv[4]) : 16;
+	int rank, nprocs, provided;
+	integrand_t f = strcmp(name, "pi") == 0 ? f_pi
+		: strcmp(name, "gauss") == 0 ? f_gauss
+		: strcmp(name, "gfun") == 0 ? f_gfun : NULL;
+	MPI_Init_thread(&argc,&argv,MPI_THREAD_FUNNELED,&provided);
+	MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+	MPI_Comm_size(MPI_COMM_WORLD,&nprocs);
+	if(f == NULL || d < 1 || d > MAXDIM || (f == f_pi && d != 2) || r < 2
+			|| max_n < 1 || max_n > (1ULL << BITS)){
+		if(rank==0)
+			printf("Usage: %s [pi|gauss|gfun] [dims<=%d] [max-samples<=2^%d] [replicates>1]\n",
+				argv[0], MAXDIM, BITS);
+		MPI_Finalize();
+		return 1;
+	}
+	sobol_init();
+	double exact = exact_value(name, d);
+	double *qmc = malloc(2 * r * sizeof(double)), *mc = qmc + r;
+	double *sums = malloc(2 * r * sizeof(double));
+	unsigned int shift[MAXDIM];
+	if(rank==0){
+		printf("Integrand %s, %d dims, exact %.10f, %d replicates, %d ranks x %d threads\n",
+			name, d, exact, r, nprocs, omp_get_max_threads());
+		printf("Samples\t\tQMC estimate\tQMC error\tMC error\tTime\n");
+	}
+	for(uint64_t n=1024; n<=max_n; n*=4){
+		/* Each rank owns a contiguous slice of every replicate's points */
+		uint64_t first = n * rank / nprocs, count = n * (rank + 1) / nprocs - first;
+		double t = MPI_Wtime();
+		for(int i=0; i<r; i++){
+			for(int j=0; j<d; j++)
+				shift[j] = (unsigned int)mix64(SEED + (uint64_t)i * MAXDIM + j);
+			sums[i] = qmc_sum(f, d, first, count, shift);
+			sums[r + i] = mc_sum(f, d, first, count, mix64(SEED ^ (uint64_t)(i + 1) << 40));
+		}
+		MPI_Reduce(sums, qmc, 2 * r, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+		t = MPI_Wtime() - t;
+		if(rank==0){
+			double qmean, qerr, mmean, merr;
+			for(int i=0; i<2*r; i++)
+				qmc[i] /= n;
+			replicate_stats(qmc, r, &qmean, &qerr);
+			replicate_stats(mc, r, &mmean, &merr);
+			printf("%8llu\t%.10f\t%.3e\t%.3e\t%.4fs\n",
+				(unsigned long long)n, qmean, qerr, merr, t);
+		}
+	}
+	free(sums);
+	free(qmc);
+	MPI_Finalize();
+	return 0;
+}
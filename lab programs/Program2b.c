@@ -0,0 +1,143 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<math.h>
+#include<mpi.h>
+#include<omp.h>
+#define TILE 64
+
+/* Rows (or columns) of an n-long dimension owned by grid coordinate p of
+   np, dealt out block-cyclically in blocks of nb */
+int numroc(int n, int nb, int p, int np){
+	int blocks = (n + nb - 1) / nb;
+	int mine = blocks / np + (p < blocks % np);
+	int count = mine * nb;
+	/* The last global block may be short */
+	if(mine > 0 && (blocks - 1) % np == p)
+		count -= blocks * nb - n;
+	return count;
+}
+
+/* Global index of local index l along a block-cyclic dimension */
+int global_index(int l, int nb, int p, int np){
+	return (l / nb * np + p) * nb + l % nb;
+}
+
+/* C += A * B on local blocks, OpenMP over TILE x TILE tiles of C */
+void local_gemm(int m, int n, int k, const double *a, int lda, const double *b, int ldb, double *c, int ldc){
+	#pragma omp parallel for collapse(2) schedule(static)
+	for(int ii=0; ii<m; ii+=TILE)
+		for(int jj=0; jj<n; jj+=TILE){
+			int ie = ii + TILE < m ? ii + TILE : m, je = jj + TILE < n ? jj + TILE : n;
+			for(int i=ii; i<ie; i++)
+				for(int p=0; p<k; p++){
+					double aip = a[(long)i*lda + p];
+					#pragma omp simd
+					for(int j=jj; j<je; j++)
+						c[(long)i*ldc + j] += aip * b[(long)p*ldb + j];
+				}
+		}
+}
+
+int main(int argc, char* argv[]){
+	int rank, nprocs, provided;
+	MPI_Init_thread(&argc,&argv,MPI_THREAD_FUNNELED,&provided);
+	MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+	MPI_Comm_size(MPI_COMM_WORLD,&nprocs);
+	int SIZE = argc > 1 ? atoi(argv[1]) : 0;
+	int nb = argc > 2 ? atoi(argv[2]) : 64;
+	if(SIZE < 1 || nb < 1){
+		if(rank==0)
+			printf("Usage: %s size [block-size]\n",argv[0]);
+		MPI_Finalize();
+		return 1;
+	}
+
+	/* Pr x Pc process grid with row and column communicators */
+	int dims[2] = {0, 0};
+	MPI_Dims_create(nprocs, 2, dims);
+	int pr = dims[0], pc = dims[1], myrow = rank / pc, mycol = rank % pc;
+	MPI_Comm row_comm, col_comm;
+	MPI_Comm_split(MPI_COMM_WORLD, myrow, mycol, &row_comm);
+	MPI_Comm_split(MPI_COMM_WORLD, mycol, myrow, &col_comm);
+
+	/* Local blocks of A, B, C; no process ever holds a full matrix */
+	int m = numroc(SIZE, nb, myrow, pr), n = numroc(SIZE, nb, mycol, pc);
+	double *a = malloc(sizeof(double) * ((long)m * n + 1));
+	double *b = malloc(sizeof(double) * ((long)m * n + 1));
+	double *c = calloc((long)m * n + 1, sizeof(double));
+	double *apanel[2], *bpanel[2];
+	for(int s=0; s<2; s++){
+		apanel[s] = malloc(sizeof(double) * ((long)m * nb + 1));
+		bpanel[s] = malloc(sizeof(double) * ((long)nb * n + 1));
+	}
+	for(int i=0; i<m; i++)
+		for(int j=0; j<n; j++){
+			int gi = global_index(i, nb, myrow, pr), gj = global_index(j, nb, mycol, pc);
+			a[(long)i*n + j] = (double)(gi + gj);
+			b[(long)i*n + j] = (double)(gi - gj);
+		}
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	double t1 = MPI_Wtime();
+	/* SUMMA: for each global block column kb of A (block row of B), the
+	   owning process column broadcasts its piece of A along the rows and
+	   the owning process row its piece of B along the columns. The
+	   broadcasts for kb+1 are in flight while the local GEMM of kb runs. */
+	int kblocks = (SIZE + nb - 1) / nb;
+	MPI_Request req[2][2];
+	for(int kb=0; kb<=kblocks; kb++){
+		if(kb < kblocks){
+			int s = kb % 2, w = SIZE - kb * nb < nb ? SIZE - kb * nb : nb;
+			int acol = kb % pc, brow = kb % pr;
+			if(mycol == acol){
+				int off = kb / pc * nb;
+				for(int i=0; i<m; i++)
+					memcpy(apanel[s] + (long)i*w, a + (long)i*n + off, w * sizeof(double));
+			}
+			if(myrow == brow)
+				memcpy(bpanel[s], b + (long)(kb / pr * nb) * n, (long)w * n * sizeof(double));
+			MPI_Ibcast(apanel[s], m * w, MPI_DOUBLE, acol, row_comm, &req[s][0]);
+			MPI_Ibcast(bpanel[s], w * n, MPI_DOUBLE, brow, col_comm, &req[s][1]);
+		}
+		if(kb > 0){
+			int s = (kb - 1) % 2, w = SIZE - (kb - 1) * nb < nb ? SIZE - (kb - 1) * nb : nb;
+			MPI_Waitall(2, req[s], MPI_STATUSES_IGNORE);
+			local_gemm(m, n, w, apanel[s], w, bpanel[s], n, c, n);
+		}
+	}
+	MPI_Barrier(MPI_COMM_WORLD);
+	double t2 = MPI_Wtime();
+
+	/* Distributed check against the closed form
+	   sum_k (i+k)(k-j) = (i-j) S1 - n i j + S2 */
+	double s1 = (double)SIZE * (SIZE - 1) / 2, s2 = (double)(SIZE - 1) * SIZE * (2.0 * SIZE - 1) / 6;
+	double err = 0, max_err;
+	for(int i=0; i<m; i++)
+		for(int j=0; j<n; j++){
+			double gi = global_index(i, nb, myrow, pr), gj = global_index(j, nb, mycol, pc);
+			double exact = (gi - gj) * s1 - SIZE * gi * gj + s2;
+			double e = fabs(c[(long)i*n + j] - exact) / (fabs(exact) > 1 ? fabs(exact) : 1);
+			if(e > err)
+				err = e;
+		}
+	MPI_Reduce(&err, &max_err, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+	if(rank==0){
+		printf("%d x %d grid, block %d, %d threads/rank\n", pr, pc, nb, omp_get_max_threads());
+		printf("%.6lf seconds with SUMMA, %.2f GFLOP/s\n", t2-t1, 2.0 * SIZE * SIZE * SIZE / (t2-t1) * 1e-9);
+		if(max_err > 1e-12){
+			printf("Error: max relative error %e\n", max_err);
+			MPI_Abort(MPI_COMM_WORLD, 1);
+		}
+		printf("SUMMA matrix multiplication test was successful!\n");
+	}
+	for(int s=0; s<2; s++){
+		free(apanel[s]);
+		free(bpanel[s]);
+	}
+	free(a);	free(b);	free(c);
+	MPI_Comm_free(&row_comm);
+	MPI_Comm_free(&col_comm);
+	MPI_Finalize();
+	return 0;
+}
@@ -1,5 +1,7 @@
 #include<math.h>
 #include<string.h>
+#include<stdlib.h>
+#include<stdint.h>
 #include<omp.h>
 #include<iostream>
 using namespace std;
@@ -109,10 +111,352 @@ long ParallelSieve(long n){
 	return count;
 }
 
-int main(){
+// Odd-only, bit-packed segmented sieve. Bit k of the sieve stands for the
+// odd number 2k+1; a set bit means composite. A segment is SEGMENT_BYTES,
+// sized for L1, and starts pre-sieved by 3, 5, 7, 11 and 13.
+const long SEGMENT_BYTES = 32 * 1024;
+const long SEGMENT_ODDS = SEGMENT_BYTES * 8;
+const long PRESIEVE_PERIOD = 3 * 5 * 7 * 11 * 13;	// in odd numbers
+const long presieve_primes[] = {3, 5, 7, 11, 13};
 
-	long size = 10000,count;
-	printf("Size\tCache Unfriendly\tCache Friendly\tParallel Sieve\n");
+// Pattern bits for the pre-sieve primes. 8 periods make a whole number of
+// bytes, so a segment starting at odd index s (a multiple of 8) is the
+// SEGMENT_BYTES bytes at offset (s / 8) % PRESIEVE_PERIOD.
+unsigned char* BuildPresieve(){
+	long bytes = PRESIEVE_PERIOD + SEGMENT_BYTES;
+	unsigned char* pattern = new unsigned char[bytes];
+	memset(pattern, 0, bytes);
+	for (long j = 0; j < 5; ++j)
+		for (long k = presieve_primes[j] / 2; k < bytes * 8; k += presieve_primes[j])
+			pattern[k >> 3] |= 1 << (k & 7);
+	return pattern;
+}
+
+// Odd primes in [17, m], the sieving primes beyond the pre-sieve
+long SmallOddPrimes(long m, long* factor){
+	long n_factor = 0;
+	bool* composite = new bool[m + 1];
+	memset(composite, 0, m + 1);
+	for (long i = 3; i <= m; i += 2)
+		if (!composite[i]) {
+			if (i >= 17)
+				factor[n_factor++] = i;
+			for (long j = i * i; j <= m; j += 2 * i)
+				composite[j] = true;
+		}
+	delete[] composite;
+	return n_factor;
+}
+
+// Sieve the segment of odd indices [s, s + SEGMENT_ODDS) and return the
+// number of primes among its first 'valid' bits. striker[k] is the next odd
+// index to strike for factor[k]; it is advanced past the segment.
+long SieveSegment(uint64_t* seg, long s, long valid, const unsigned char* pattern,
+		const long* factor, long* striker, long n_factor){
+	memcpy(seg, pattern + (s / 8) % PRESIEVE_PERIOD, SEGMENT_BYTES);
+	if (s == 0)
+		seg[0] |= 1;	// 1 is not prime
+	long end = s + valid;
+	for (long k = 0; k < n_factor; ++k) {
+		long p = factor[k], i = striker[k];
+		for (; i < end; i += p)
+			seg[(i - s) >> 6] |= 1ULL << ((i - s) & 63);
+		striker[k] = i;
+	}
+	long count = 0, words = valid >> 6;
+	for (long w = 0; w < words; ++w)
+		count += 64 - __builtin_popcountll(seg[w]);
+	if (valid & 63)
+		count += (valid & 63) - __builtin_popcountll(seg[words] & ((1ULL << (valid & 63)) - 1));
+	return count;
+}
+
+// First odd index >= s holding an odd multiple of p that is at least p*p
+inline long FirstStrike(long p, long s){
+	long i = (p * p - 1) / 2;
+	if (i < s)
+		i += (s - i + p - 1) / p * p;
+	return i;
+}
+
+// Primes up to n plus the pre-sieve primes that were struck as composites
+long BitSieveBase(long n){
+	long count = n >= 2;
+	for (long j = 0; j < 5; ++j)
+		count += presieve_primes[j] <= n;
+	return count;
+}
+
+long SegmentedBitSieve(long n)
+{
+	long m = (long)sqrt((double)n), odds = n >= 1 ? (n - 1) / 2 + 1 : 0;
+	long* factor = new long[m / 2 + 1];
+	long* striker = new long[m / 2 + 1];
+	uint64_t* seg = new uint64_t[SEGMENT_BYTES / 8];
+	unsigned char* pattern = BuildPresieve();
+	t = omp_get_wtime();
+	long n_factor = SmallOddPrimes(m, factor);
+	long count = BitSieveBase(n);
+	for (long k = 0; k < n_factor; ++k)
+		striker[k] = FirstStrike(factor[k], 0);
+	for (long s = 0; s < odds; s += SEGMENT_ODDS)
+		count += SieveSegment(seg, s, min(SEGMENT_ODDS, odds - s), pattern,
+				factor, striker, n_factor);
+	t = omp_get_wtime() - t;
+	delete[] pattern;	delete[] seg;	delete[] striker;	delete[] factor;
+	return count;
+}
+
+// Each thread sieves one contiguous range of segments, with its own
+// strikers, so segments never change hands between threads
+long ParallelBitSieve(long n)
+{
+	long m = (long)sqrt((double)n), odds = n >= 1 ? (n - 1) / 2 + 1 : 0;
+	long* factor = new long[m / 2 + 1];
+	unsigned char* pattern = BuildPresieve();
+	t = omp_get_wtime();
+	long n_factor = SmallOddPrimes(m, factor);
+	long count = BitSieveBase(n);
+	long n_seg = (odds + SEGMENT_ODDS - 1) / SEGMENT_ODDS;
+	#pragma omp parallel reduction(+:count)
+	{
+		long nt = omp_get_num_threads(), id = omp_get_thread_num();
+		long first = n_seg * id / nt, last = n_seg * (id + 1) / nt;
+		long* striker = new long[n_factor + 1];
+		uint64_t* seg = new uint64_t[SEGMENT_BYTES / 8];
+		for (long k = 0; k < n_factor; ++k)
+			striker[k] = FirstStrike(factor[k], first * SEGMENT_ODDS);
+		for (long g = first; g < last; ++g) {
+			long s = g * SEGMENT_ODDS;
+			count += SieveSegment(seg, s, min(SEGMENT_ODDS, odds - s), pattern,
+					factor, striker, n_factor);
+		}
+		delete[] seg;	delete[] striker;
+	}
+	t = omp_get_wtime() - t;
+	delete[] pattern;	delete[] factor;
+	return count;
+}
+
+// Receives the primes of one segment, in ascending order
+typedef void (*PrimeSink)(const long* primes, long n, void* arg);
+
+// Append the primes in [lo, hi] of a sieved segment to out
+long ExtractPrimes(const uint64_t* seg, long s, long valid, long lo, long hi, long* out){
+	long n = 0, words = (valid + 63) >> 6;
+	for (long w = 0; w < words; ++w) {
+		uint64_t bits = ~seg[w];
+		if (w == words - 1 && (valid & 63))
+			bits &= (1ULL << (valid & 63)) - 1;
+		while (bits) {
+			long p = 2 * (s + (w << 6) + __builtin_ctzll(bits)) + 1;
+			bits &= bits - 1;
+			if (p >= lo && p <= hi)
+				out[n++] = p;
+		}
+	}
+	return n;
+}
+
+// Streams every prime in [lo, hi] to sink, in ascending order, and returns
+// how many there were. Threads sieve whole segments and hand them to sink in
+// segment order through an ordered region, so memory stays at one segment
+// per thread and no thread waits on a barrier between windows.
+long EnumeratePrimes(long lo, long hi, PrimeSink sink, void* arg)
+{
+	if (lo < 2)
+		lo = 2;
+	if (hi < lo)
+		return 0;
+	long m = (long)sqrt((double)hi), odds = (hi - 1) / 2 + 1;
+	long* factor = new long[m / 2 + 1];
+	unsigned char* pattern = BuildPresieve();
+	long n_factor = SmallOddPrimes(m, factor);
+	long first = (lo / 2) / SEGMENT_ODDS, last = (odds + SEGMENT_ODDS - 1) / SEGMENT_ODDS;
+	long count = 0;
+	#pragma omp parallel reduction(+:count)
+	{
+		long* striker = new long[n_factor + 1];
+		uint64_t* seg = new uint64_t[SEGMENT_BYTES / 8];
+		long* primes = new long[SEGMENT_ODDS + 1];
+		#pragma omp for ordered schedule(dynamic)
+		for (long g = first; g < last; ++g) {
+			long s = g * SEGMENT_ODDS, valid = min(SEGMENT_ODDS, odds - s), n = 0;
+			for (long k = 0; k < n_factor; ++k)
+				striker[k] = FirstStrike(factor[k], s);
+			SieveSegment(seg, s, valid, pattern, factor, striker, n_factor);
+			if (s == 0) {
+				primes[n++] = 2;
+				for (long j = 0; j < 5; ++j)	// undo the pre-sieve on itself
+					seg[0] &= ~(1ULL << (presieve_primes[j] / 2));
+			}
+			if (n && lo > 2)
+				n = 0;
+			n += ExtractPrimes(seg, s, valid, lo, hi, primes + n);
+			count += n;
+			#pragma omp ordered
+			sink(primes, n, arg);
+		}
+		delete[] primes;	delete[] seg;	delete[] striker;
+	}
+	delete[] pattern;	delete[] factor;
+	return count;
+}
+
+// Example sink: checks ascending order and folds the primes into a hash
+struct PrimeDigest {
+	long last;
+	uint64_t hash;
+	bool ordered;
+};
+void DigestPrimes(const long* primes, long n, void* arg){
+	PrimeDigest* d = (PrimeDigest*)arg;
+	for (long i = 0; i < n; ++i) {
+		if (primes[i] <= d->last)
+			d->ordered = false;
+		d->last = primes[i];
+		d->hash = (d->hash ^ (uint64_t)primes[i]) * 0x100000001b3ULL;
+	}
+}
+
+// Meissel-Lehmer prime counting:
+//   pi(x) = phi(x, a) + a - 1 - P2(x, a),   a = pi(cbrt(x)),
+// where phi(x, a) counts the n <= x free of the first a primes and P2 counts
+// the n <= x with exactly two prime factors above p_a. Every pi(v) it needs
+// has v <= x^(2/3), answered from a compressed table built by the sieve.
+const long PHI_SMALL = 6;	// phi(x, a <= 6) by table, period 2*3*5*7*11*13
+
+struct PrimeCounter {
+	long limit;			// pi(v) is known for v <= limit
+	uint64_t* bits;		// bit k set iff 2k+1 is prime
+	uint32_t* prefix;	// odd primes in the words before each word
+	long* primes;		// primes[1..n_primes], primes[0] = 1
+	long n_primes, keep;	// keep primes up to 'keep' in primes[]
+	long phi_mod[PHI_SMALL + 1];
+	long* phi_table[PHI_SMALL + 1];
+};
+
+void CollectPrimes(const long* p, long n, void* arg){
+	PrimeCounter* pc = (PrimeCounter*)arg;
+	for (long i = 0; i < n; ++i) {
+		if (p[i] & 1)
+			pc->bits[p[i] >> 7] |= 1ULL << ((p[i] >> 1) & 63);
+		if (p[i] <= pc->keep)
+			pc->primes[++pc->n_primes] = p[i];
+	}
+}
+
+inline long PrimePi(const PrimeCounter* pc, long v){
+	if (v < 3)
+		return v >= 2;
+	long k = (v - 1) / 2, w = k >> 6;
+	uint64_t mask = (k & 63) == 63 ? ~0ULL : (2ULL << (k & 63)) - 1;
+	return 1 + pc->prefix[w] + __builtin_popcountll(pc->bits[w] & mask);
+}
+
+inline long PhiSmall(const PrimeCounter* pc, long x, long a){
+	long q = pc->phi_mod[a];
+	return x / q * pc->phi_table[a][q] + pc->phi_table[a][x % q];
+}
+
+// phi(x, a), expanding phi(x, a) = phi(x, a-1) - phi(x / p_a, a-1) until
+// a is small or x < p_{a+1}^2, where phi(x, a) = max(pi(x) - a + 1, 1)
+long Phi(const PrimeCounter* pc, long x, long a){
+	if (a <= PHI_SMALL)
+		return PhiSmall(pc, x, a);
+	if (x <= pc->limit && x < pc->primes[a + 1] * pc->primes[a + 1])
+		return x < 1 ? 0 : max(PrimePi(pc, x) - a + 1, 1L);
+	long sum = PhiSmall(pc, x, PHI_SMALL);
+	for (long i = PHI_SMALL + 1; i <= a; ++i) {
+		long y = x / pc->primes[i];
+		if (y < pc->primes[i])	// phi(y, i-1) = 1 from here on
+			return sum - (a - i + 1);
+		sum -= Phi(pc, y, i - 1);
+	}
+	return sum;
+}
+
+long IntRoot(long x, int k){
+	long r = (long)pow((double)x, 1.0 / k);
+	while (r > 0 && (k == 2 ? r * r : r * r * r) > x)
+		--r;
+	while ((k == 2 ? (r + 1) * (r + 1) : (r + 1) * (r + 1) * (r + 1)) <= x)
+		++r;
+	return r;
+}
+
+long MeisselLehmerCount(long x)
+{
+	if (x < 2)
+		return 0;
+	PrimeCounter pc;
+	long s = IntRoot(x, 2), c = IntRoot(x, 3);
+	// Room for p_{a+1} and p_{b+1} (Bertrand), and all of x / p for p > c
+	pc.keep = 2 * s + 16;
+	pc.limit = max(x / (c + 1), pc.keep);
+	long words = pc.limit / 128 + 1;
+	pc.bits = new uint64_t[words];
+	pc.prefix = new uint32_t[words];
+	pc.primes = new long[pc.keep / 2 + 16];
+	memset(pc.bits, 0, words * sizeof(uint64_t));
+	pc.primes[0] = 1;
+	pc.n_primes = 0;
+	t = omp_get_wtime();
+	EnumeratePrimes(2, pc.limit, CollectPrimes, &pc);
+	for (long w = 0, sum = 0; w < words; ++w) {
+		pc.prefix[w] = (uint32_t)sum;
+		sum += __builtin_popcountll(pc.bits[w]);
+	}
+	// phi(r, a) for r in one period of the first a primes, plus the period total
+	for (long a = 0, q = 1; a <= PHI_SMALL; q *= pc.primes[++a]) {
+		pc.phi_mod[a] = q;
+		pc.phi_table[a] = new long[q + 1];
+		for (long r = 0, n = 0; r <= q; ++r) {
+			bool coprime = r > 0;
+			for (long i = 1; i <= a && coprime; ++i)
+				coprime = r % pc.primes[i] != 0;
+			pc.phi_table[a][r] = n += coprime;
+		}
+		if (a == PHI_SMALL)
+			break;
+	}
+	long a = PrimePi(&pc, c), b = PrimePi(&pc, s);
+	long count = a - 1;
+	// Top-level terms of phi(x, a) are independent; their cost falls off
+	// sharply with i, so they are handed out dynamically
+	if (a <= PHI_SMALL)
+		count += PhiSmall(&pc, x, a);
+	else {
+		long phi = PhiSmall(&pc, x, PHI_SMALL);
+		#pragma omp parallel for schedule(dynamic) reduction(-:phi)
+		for (long i = PHI_SMALL + 1; i <= a; ++i)
+			phi -= Phi(&pc, x / pc.primes[i], i - 1);
+		count += phi;
+	}
+	#pragma omp parallel for schedule(dynamic, 64) reduction(-:count)
+	for (long i = a + 1; i <= b; ++i)
+		count -= PrimePi(&pc, x / pc.primes[i]) - (i - 1);
+	t = omp_get_wtime() - t;
+	for (long k = 0; k <= PHI_SMALL; ++k)
+		delete[] pc.phi_table[k];
+	delete[] pc.primes;	delete[] pc.prefix;	delete[] pc.bits;
+	return count;
+}
+
+int main(int argc, char* argv[]){
+
+	long size = 10000,count,expected;
+	// Sublinear mode: pi(x) for each x given on the command line
+	if(argc > 1){
+		printf("x\t\tpi(x)\t\tMeissel-Lehmer\n");
+		for(int i=1; i<argc; i++){
+			long x = (long)strtod(argv[i], NULL);
+			count = MeisselLehmerCount(x);
+			printf("%ld\t%ld\t%.4f\n",x,count,t);
+		}
+		return 0;
+	}
+	printf("Size\tCache Unfriendly\tCache Friendly\tParallel Sieve\tBit Sieve\tParallel Bit Sieve\tEnumerate\tPrime Hash\t\tMeissel-Lehmer\n");
 	for(int i=1; i<=4; i++ ){
 		size = size*10;
 		printf("%9ld\t",size);
@@ -120,10 +464,29 @@ int main(){
 //			printf("\t");
 		count = CacheUnfriendlySieve(size);
 		printf("%.4f\t\t",t);
-		count = CacheFriendlySieve(size);
+		expected = CacheFriendlySieve(size);
 		printf("%.4f\t\t",t);
 		count = ParallelSieve(size);
+		printf("%.4f\t\t",t);
+		count = SegmentedBitSieve(size);
+		printf("%.4f\t\t",t);
+		if(count != expected)
+			printf("\nError: bit sieve counted %ld primes, expected %ld\n", count, expected);
+		count = ParallelBitSieve(size);
+		printf("%.4f\t\t",t);
+		if(count != expected)
+			printf("\nError: parallel bit sieve counted %ld primes, expected %ld\n", count, expected);
+		PrimeDigest digest = {0, 0xcbf29ce484222325ULL, true};
+		t = omp_get_wtime();
+		count = EnumeratePrimes(2, size, DigestPrimes, &digest);
+		t = omp_get_wtime() - t;
+		printf("%.4f\t%016llx\t",t,(unsigned long long)digest.hash);
+		if(count != expected || !digest.ordered)
+			printf("\nError: enumeration gave %ld primes%s, expected %ld\n", count, digest.ordered ? "" : " out of order", expected);
+		count = MeisselLehmerCount(size);
 		printf("%.4f\n",t);
+		if(count != expected)
+			printf("Error: Meissel-Lehmer counted %ld primes, expected %ld\n", count, expected);
 	}
 	return 0;
 }
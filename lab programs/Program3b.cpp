@@ -0,0 +1,198 @@
+#include<math.h>
+#include<string.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<mpi.h>
+#include<omp.h>
+#include<iostream>
+using namespace std;
+// Odd-only, bit-packed segmented sieve. Bit k of the sieve stands for the
+// odd number 2k+1; a set bit means composite. A segment is SEGMENT_BYTES,
+// sized for L1, and starts pre-sieved by 3, 5, 7, 11 and 13.
+const long SEGMENT_BYTES = 32 * 1024;
+const long SEGMENT_ODDS = SEGMENT_BYTES * 8;
+const long PRESIEVE_PERIOD = 3 * 5 * 7 * 11 * 13;	// in odd numbers
+const long presieve_primes[] = {3, 5, 7, 11, 13};
+
+// Pattern bits for the pre-sieve primes. 8 periods make a whole number of
+// bytes, so a segment starting at odd index s (a multiple of 8) is the
+// SEGMENT_BYTES bytes at offset (s / 8) % PRESIEVE_PERIOD.
+unsigned char* BuildPresieve(){
+	long bytes = PRESIEVE_PERIOD + SEGMENT_BYTES;
+	unsigned char* pattern = new unsigned char[bytes];
+	memset(pattern, 0, bytes);
+	for (long j = 0; j < 5; ++j)
+		for (long k = presieve_primes[j] / 2; k < bytes * 8; k += presieve_primes[j])
+			pattern[k >> 3] |= 1 << (k & 7);
+	return pattern;
+}
+
+// Odd primes in [17, m], the sieving primes beyond the pre-sieve
+long SmallOddPrimes(long m, long* factor){
+	long n_factor = 0;
+	bool* composite = new bool[m + 1];
+	memset(composite, 0, m + 1);
+	for (long i = 3; i <= m; i += 2)
+		if (!composite[i]) {
+			if (i >= 17)
+				factor[n_factor++] = i;
+			for (long j = i * i; j <= m; j += 2 * i)
+				composite[j] = true;
+		}
+	delete[] composite;
+	return n_factor;
+}
+
+// Sieve the segment of odd indices [s, s + SEGMENT_ODDS) and return the
+// number of primes among its first 'valid' bits. striker[k] is the next odd
+// index to strike for factor[k]; it is advanced past the segment.
+long SieveSegment(uint64_t* seg, long s, long valid, const unsigned char* pattern,
+		const long* factor, long* striker, long n_factor){
+	memcpy(seg, pattern + (s / 8) % PRESIEVE_PERIOD, SEGMENT_BYTES);
+	if (s == 0)
+		seg[0] |= 1;	// 1 is not prime
+	long end = s + valid;
+	for (long k = 0; k < n_factor; ++k) {
+		long p = factor[k], i = striker[k];
+		for (; i < end; i += p)
+			seg[(i - s) >> 6] |= 1ULL << ((i - s) & 63);
+		striker[k] = i;
+	}
+	long count = 0, words = valid >> 6;
+	for (long w = 0; w < words; ++w)
+		count += 64 - __builtin_popcountll(seg[w]);
+	if (valid & 63)
+		count += (valid & 63) - __builtin_popcountll(seg[words] & ((1ULL << (valid & 63)) - 1));
+	return count;
+}
+
+// First odd index >= s holding an odd multiple of p that is at least p*p
+inline long FirstStrike(long p, long s){
+	long i = (p * p - 1) / 2;
+	if (i < s)
+		i += (s - i + p - 1) / p * p;
+	return i;
+}
+
+// Primes up to n plus the pre-sieve primes that were struck as composites
+long BitSieveBase(long n){
+	long count = n >= 2;
+	for (long j = 0; j < 5; ++j)
+		count += presieve_primes[j] <= n;
+	return count;
+}
+
+
+// pi(10^k), to check the distributed count
+const long known_pi[] = {0, 4, 25, 168, 1229, 9592, 78498, 664579, 5761455,
+	50847534, 455052511, 4118054813L, 37607912018L, 346065536839L};
+
+int main(int argc, char* argv[]){
+	int rank, nprocs, provided;
+	MPI_Init_thread(&argc,&argv,MPI_THREAD_FUNNELED,&provided);
+	MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+	MPI_Comm_size(MPI_COMM_WORLD,&nprocs);
+	long n = argc > 1 ? (long)strtod(argv[1], NULL) : 0;
+	long chunk_segments = argc > 2 ? atol(argv[2]) : 16;
+	if(n < 2 || chunk_segments < 1){
+		if(rank==0)
+			printf("Usage: %s n [segments-per-chunk]\n",argv[0]);
+		MPI_Finalize();
+		return 1;
+	}
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	double t = MPI_Wtime();
+	// Every rank sieves the base primes up to sqrt(n) itself
+	long m = (long)sqrt((double)n), odds = (n - 1) / 2 + 1;
+	long* factor = new long[m / 2 + 1];
+	long n_factor = SmallOddPrimes(m, factor);
+	unsigned char* pattern = BuildPresieve();
+	long chunk_odds = chunk_segments * SEGMENT_ODDS;
+	long n_chunks = (odds + chunk_odds - 1) / chunk_odds;
+
+	// Chunks are handed out from a shared counter on rank 0: a rank that
+	// finishes early, or drew cheap chunks, simply takes more
+	long *next, chunk, taken = 0;
+	MPI_Win win;
+	MPI_Win_allocate(rank == 0 ? sizeof(long) : 0, sizeof(long), MPI_INFO_NULL, MPI_COMM_WORLD, &next, &win);
+	if(rank == 0){
+		MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, win);
+		*next = 0;
+		MPI_Win_unlock(0, win);
+	}
+	MPI_Barrier(MPI_COMM_WORLD);
+	long* chunk_count = new long[n_chunks]();
+	long* striker = new long[(long)omp_get_max_threads() * (n_factor + 1)];
+	uint64_t* segs = new uint64_t[(long)omp_get_max_threads() * (SEGMENT_BYTES / 8)];
+	const long one = 1;
+	for(;;){
+		MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, win);
+		MPI_Fetch_and_op(&one, &chunk, MPI_LONG, 0, 0, MPI_SUM, win);
+		MPI_Win_unlock(0, win);
+		if(chunk >= n_chunks)
+			break;
+		taken++;
+		long first = chunk * chunk_segments, last = min(first + chunk_segments, (odds + SEGMENT_ODDS - 1) / SEGMENT_ODDS);
+		long count = 0;
+		// The chunk's segments are split across threads, each with its own
+		// strike offsets and segment buffer
+		#pragma omp parallel reduction(+:count)
+		{
+			long nt = omp_get_num_threads(), id = omp_get_thread_num();
+			long lo = first + (last - first) * id / nt, hi = first + (last - first) * (id + 1) / nt;
+			long* my_striker = striker + id * (n_factor + 1);
+			uint64_t* seg = segs + id * (SEGMENT_BYTES / 8);
+			for (long k = 0; k < n_factor; ++k)
+				my_striker[k] = FirstStrike(factor[k], lo * SEGMENT_ODDS);
+			for (long g = lo; g < hi; ++g) {
+				long s = g * SEGMENT_ODDS;
+				count += SieveSegment(seg, s, min(SEGMENT_ODDS, odds - s), pattern,
+						factor, my_striker, n_factor);
+			}
+		}
+		chunk_count[chunk] = count;
+	}
+	MPI_Win_free(&win);
+
+	// Total with a reduction; the per-chunk counts are combined on rank 0
+	// too, which works out where each chunk's primes fall in the global order
+	long local = 0, total, *all_taken = new long[nprocs];
+	for(long c=0; c<n_chunks; c++)
+		local += chunk_count[c];
+	if(rank == 0)
+		local += BitSieveBase(n);
+	MPI_Reduce(&local, &total, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+	if(rank == 0)
+		MPI_Reduce(MPI_IN_PLACE, chunk_count, n_chunks, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+	else
+		MPI_Reduce(chunk_count, NULL, n_chunks, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+	MPI_Gather(&taken, 1, MPI_LONG, all_taken, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+	t = MPI_Wtime() - t;
+
+	if(rank==0){
+		// Index of the first prime of each chunk: an exclusive prefix sum
+		long* boundary = new long[n_chunks + 1];
+		chunk_count[0] += BitSieveBase(n);	// 2 and the pre-sieve primes
+		boundary[0] = 0;
+		for(long c=0; c<n_chunks; c++)
+			boundary[c + 1] = boundary[c] + chunk_count[c];
+		printf("pi(%ld) = %ld\t%.4f seconds, %d ranks x %d threads\n", n, total, t, nprocs, omp_get_max_threads());
+		printf("Chunks of %ld numbers: %ld, last one starts at prime #%ld\n", 2 * chunk_odds, n_chunks,
+			boundary[n_chunks - 1] + 1);
+		printf("Chunks per rank:");
+		for(int r=0; r<nprocs; r++)
+			printf(" %ld", all_taken[r]);
+		printf("\n");
+		if(boundary[n_chunks] != total)
+			printf("Error: chunk counts add up to %ld, total is %ld\n", boundary[n_chunks], total);
+		for(int k=0; k<14; k++)
+			if(n == (long)pow(10.0, k) && total != known_pi[k])
+				printf("Error: expected %ld primes\n", known_pi[k]);
+		delete[] boundary;
+	}
+	delete[] all_taken;	delete[] segs;	delete[] striker;	delete[] chunk_count;
+	delete[] pattern;	delete[] factor;
+	MPI_Finalize();
+	return 0;
+}
@@ -4,57 +4,103 @@
 #include<string.h>
 #include<omp.h>
 
+/* Gray = (r+g+b)/3 of one truecolor pixel, keeping alpha */
+static inline unsigned int gray(unsigned int p){
+	unsigned int g = (((p >> 16) & 0xff) + ((p >> 8) & 0xff) + (p & 0xff)) / 3;
+	return (p & 0x7f000000) | g << 16 | g << 8 | g;
+}
+
+/* Gray over a contiguous run of pixels: a few shifts, adds and a multiply
+   per SIMD lane */
+static void gray_row(int *row, long w){
+	#pragma omp simd
+	for(long x = 0; x < w; x++)
+		row[x] = gray(row[x]);
+}
+
+/* Column order: threads split x, each walks down its columns, striding
+   across rows on every pixel */
+static void gray_columns(gdImagePtr img, long w, long h){
+	#pragma omp parallel for schedule(runtime)
+	for(long x = 0; x < w; x++)
+		for(long y = 0; y < h; y++)
+			img->tpixels[y][x] = gray(img->tpixels[y][x]);
+}
+
+/* Row-major tiles of tw x th pixels, numbered across then down and dealt
+   out by the runtime schedule; inside a tile each row is one SIMD run */
+static void gray_tiles(gdImagePtr img, long w, long h, long tw, long th){
+	long nx = (w + tw - 1) / tw, ny = (h + th - 1) / th;
+	#pragma omp parallel for schedule(runtime)
+	for(long k = 0; k < nx * ny; k++){
+		long x0 = k % nx * tw, y0 = k / nx * th;
+		long xw = w - x0 < tw ? w - x0 : tw, ye = h - y0 < th ? h : y0 + th;
+		for(long y = y0; y < ye; y++)
+			gray_row(img->tpixels[y] + x0, xw);
+	}
+}
+
 int main(int argc, char **argv) 
 {
 	FILE *fp,*fp1 = {0};
 	gdImagePtr img;
 	char iname[15], oname[15];
-	int color, x, y, i=0, red, green, blue,tmp;
+	int i=0;
 	long w,h;
+	/* Tile shape WxH, W = 0 for whole rows; -b also times the column order */
+	long tile_w = 0, tile_h = 16;
+	int bench = 0;
+	for(int a=1; a<argc; a++){
+		if(strcmp(argv[a], "-b") == 0)
+			bench = 1;
+		else if(sscanf(argv[a], "%ldx%ld", &tile_w, &tile_h) != 2 || tile_w < 0 || tile_h < 1){
+			printf("Usage: %s [<tile-width>x<tile-height>] [-b]\n", argv[0]);
+			return 1;
+		}
+	}
 	omp_sched_t def_sched; int def_chunk_size;
 	omp_get_schedule(&def_sched,&def_chunk_size);
 	printf("Deafault %d %d \n",def_sched,def_chunk_size);
-	printf("Size\t\tDefault\t\tStatic\t\tDynamic\t\tGuided\n");
+	printf("Size\t\tOrder\tDefault\t\tStatic\t\tDynamic\t\tGuided\n");
 	for(int i=0;i<4;i++){
 		sprintf(iname,"in%d.png",i+1);
-		for(int sched=0x0; sched<=0x3; sched++){
-			fp = fopen(iname,"r");
-			sprintf(oname,"Output%d%d.png",i+1,sched);
-			img = gdImageCreateFromPng(fp);
-			w = gdImageSX(img);
-			h = gdImageSY(img);
-
-			if(sched == 0x0){
-				printf("%4ldx%4ld\t",w,h);
-				//if(i<=1) printf("\t");
-				omp_set_schedule(def_sched, def_chunk_size);
-			}
-			else
-				omp_set_schedule(sched, 0);
-			
-			double t = omp_get_wtime();
-			#pragma omp parallel for private(y,color,red,green,blue,tmp)
-			for(x = 0; x < w; x++){
-				for(y = 0; y < h; y++){
-					color=gdImageGetPixel(img, x, y);
-					red   = gdImageRed(img, color);
-					green = gdImageGreen(img, color);
-					blue  = gdImageBlue(img, color);
-					tmp = (red+green+blue)/ 3;
-					red = green = blue = tmp;
-					color = gdImageColorAllocate(img, red, green, blue);
-					gdImageSetPixel(img, x, y, color);
+		for(int order=0; order<=bench; order++){
+			for(int sched=0x0; sched<=0x3; sched++){
+				fp = fopen(iname,"r");
+				/* -b keeps the column-order results apart from the tiled ones */
+				sprintf(oname,"Output%d%d%s.png",i+1,sched,order == 0 ? "" : "c");
+				img = gdImageCreateFromPng(fp);
+				fclose(fp);
+				w = gdImageSX(img);
+				h = gdImageSY(img);
+
+				if(sched == 0x0){
+					printf("%4ldx%4ld\t%s\t",w,h,order == 0 ? "tiles" : "columns");
+					//if(i<=1) printf("\t");
+					omp_set_schedule(def_sched, def_chunk_size);
 				}
-			}
-			t = omp_get_wtime() - t;
-			fp1 = fopen(oname,"w");
-			gdImagePng(img, fp1);
-			fclose(fp1);
+				else
+					omp_set_schedule(sched, 0);
+				/* Work on gd's own truecolor rows: no per-pixel library
+				   calls, no palette shared between threads, and the encoder
+				   reads the result straight back */
+				gdImagePaletteToTrueColor(img);
 
-			gdImageDestroy(img);
-			printf("%.4fms\t",t*1000);
+				double t = omp_get_wtime();
+				if(order == 0)
+					gray_tiles(img, w, h, tile_w > 0 ? tile_w : w, tile_h);
+				else
+					gray_columns(img, w, h);
+				t = omp_get_wtime() - t;
+				fp1 = fopen(oname,"w");
+				gdImagePng(img, fp1);
+				fclose(fp1);
+
+				gdImageDestroy(img);
+				printf("%.4fms\t",t*1000);
+			}
+			printf("\n");
 		}
-		printf("\n");
 	}
 	return 0;
 }
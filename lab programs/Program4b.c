@@ -4,69 +4,112 @@
 #include<string.h>
 #include<omp.h>
 
+/* Gray pixel (x, y), then keep only the channel matching the thread that
+   did it, so the output shows how the schedule split the image */
+static void color_pixel(gdImagePtr img, int x, int y){
+	int color, red, green, blue, tmp, tid;
+	tid = omp_get_thread_num();
+	color = gdImageGetPixel(img, x, y);
+	red = gdImageRed(img, color);
+	green = gdImageGreen(img, color);
+	blue = gdImageBlue(img, color);
+	tmp = (red + green + blue) / 3;
+	red = green = blue = tmp;
+	if (tid == 0){
+		color = gdImageColorAllocate(img, red, 0, 0);
+		gdImageSetPixel(img, x, y, color);
+	}
+	if (tid == 1){
+		color = gdImageColorAllocate(img, 0, green, 0);
+		gdImageSetPixel(img, x, y, color);
+	}
+	if (tid == 2){
+		color = gdImageColorAllocate(img, 0, 0, blue);
+		gdImageSetPixel(img, x, y, color);
+	}
+	if (tid == 3){
+		color = gdImageColorAllocate(img, red, green, blue);
+		gdImageSetPixel(img, x, y, color);
+	}
+}
+
+/* Column order: threads split x and walk down their columns */
+static void color_columns(gdImagePtr img, int w, int h){
+	int x, y;
+	#pragma omp parallel for private(x,y) schedule(runtime) num_threads(4)
+	for(x = 0; x < w; x++)
+		for(y = 0; y < h; y++)
+			color_pixel(img, x, y);
+}
+
+/* Row-major tiles of tw x th pixels, dealt out by the runtime schedule */
+static void color_tiles(gdImagePtr img, int w, int h, int tw, int th){
+	int nx = (w + tw - 1) / tw, ny = (h + th - 1) / th;
+	#pragma omp parallel for schedule(runtime) num_threads(4)
+	for(int k = 0; k < nx * ny; k++){
+		int x0 = k % nx * tw, y0 = k / nx * th;
+		for(int y = y0; y < y0 + th && y < h; y++)
+			for(int x = x0; x < x0 + tw && x < w; x++)
+				color_pixel(img, x, y);
+	}
+}
+
 int main(int argc, char **argv) 
 {
 	FILE *fp,*fp1 = {0};
 	gdImagePtr img;
 	char iname[15], oname[15];
-	int color, x, y, i=0, red, green, blue,tmp, tid;
+	int i=0;
 	long w,h;
+	/* Tile shape WxH, W = 0 for whole rows; -b also times the column order */
+	int tile_w = 0, tile_h = 16, bench = 0;
+	for(int a=1; a<argc; a++){
+		if(strcmp(argv[a], "-b") == 0)
+			bench = 1;
+		else if(sscanf(argv[a], "%dx%d", &tile_w, &tile_h) != 2 || tile_w < 0 || tile_h < 1){
+			printf("Usage: %s [<tile-width>x<tile-height>] [-b]\n", argv[0]);
+			return 1;
+		}
+	}
 	omp_sched_t def_sched; int def_chunk_size;
 	omp_get_schedule(&def_sched,&def_chunk_size);
 	printf("Deafault %d %d \n",def_sched,def_chunk_size);
-	printf("Size\t\tStatic\t\tDynamic\t\tGuided\n");
+	printf("Size\t\tOrder\tStatic\t\tDynamic\t\tGuided\n");
 	for(int i=0;i<4;i++){
 		sprintf(iname,"in%d.png",i+1);
-		for(int sched=0x01; sched<=0x03; sched++){
-			fp = fopen(iname,"r");
-			sprintf(oname,"Output%d%d.png",i+1,sched);
-			img = gdImageCreateFromPng(fp);
-			w = gdImageSX(img);
-			h = gdImageSY(img);
+		for(int order=0; order<=bench; order++){
+			for(int sched=0x01; sched<=0x03; sched++){
+				fp = fopen(iname,"r");
+				sprintf(oname,"Output%d%d.png",i+1,sched);
+				img = gdImageCreateFromPng(fp);
+				fclose(fp);
+				w = gdImageSX(img);
+				h = gdImageSY(img);
 
-			if(sched == 0x1){
-				printf("%4ldx%4ld\t",w,h);
-			}
-            omp_set_schedule(sched, 100);
-			
-			double t = omp_get_wtime();
-			#pragma omp parallel for private(x,y,color,red,blue,green,tid) schedule(runtime) num_threads(4)
-			for(x = 0; x < w; x++){
-				for(y = 0; y < h; y++){
-					tid = omp_get_thread_num();
-					color = gdImageGetPixel(img, x, y);
-			        red = gdImageRed(img, color);
-			        green = gdImageGreen(img, color);
-			        blue = gdImageBlue(img, color);
-			        tmp = (red + green + blue) / 3;
-			        red = green = blue = tmp;
-					if (tid == 0){
-			            color = gdImageColorAllocate(img, red, 0, 0);
-			            gdImageSetPixel(img, x, y, color);
-			        }
-			        if (tid == 1){
-			            color = gdImageColorAllocate(img, 0, green, 0);
-			            gdImageSetPixel(img, x, y, color);
-			        }
-			        if (tid == 2){
-			            color = gdImageColorAllocate(img, 0, 0, blue);
-			            gdImageSetPixel(img, x, y, color);
-			        }
-			        if (tid == 3){
-			            color = gdImageColorAllocate(img, red, green, blue);
-			            gdImageSetPixel(img, x, y, color);
-			        }
+				if(sched == 0x1){
+					printf("%4ldx%4ld\t%s\t",w,h,order == 0 ? "tiles" : "columns");
 				}
-			}
-			t = omp_get_wtime() - t;
-			fp1 = fopen(oname,"w");
-			gdImagePng(img, fp1);
-			fclose(fp1);
+				/* Chunks of 100 columns, or of as many tiles as cover the
+				   same area, so each schedule still deals out several chunks */
+				long tw = tile_w > 0 ? tile_w : w;
+				long chunk = order == 0 ? 100 * h / (tw * tile_h) : 100;
+				omp_set_schedule(sched, chunk > 0 ? chunk : 1);
+			
+				double t = omp_get_wtime();
+				if(order == 0)
+					color_tiles(img, w, h, tw, tile_h);
+				else
+					color_columns(img, w, h);
+				t = omp_get_wtime() - t;
+				fp1 = fopen(oname,"w");
+				gdImagePng(img, fp1);
+				fclose(fp1);
 
-			gdImageDestroy(img);
-			printf("%.4fms\t",t*1000);
+				gdImageDestroy(img);
+				printf("%.4fms\t",t*1000);
+			}
+			printf("\n");
 		}
-		printf("\n");
 	}
 	return 0;
 }
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <gd.h>
+#include<omp.h>
+#define QUEUE_SIZE 4
+#define NAME_LEN 512
+
+/* One image moving through the pipeline; img == NULL marks end of stream */
+struct job {
+	char name[NAME_LEN];
+	gdImagePtr img;
+};
+
+/* Bounded queue: producers block when it is full, consumers when empty, so
+   at most QUEUE_SIZE decoded images wait between two stages */
+struct queue {
+	struct job item[QUEUE_SIZE];
+	int head, count;
+	pthread_mutex_t lock;
+	pthread_cond_t not_full, not_empty;
+};
+
+void queue_init(struct queue *q){
+	q->head = q->count = 0;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+}
+
+void queue_push(struct queue *q, struct job j){
+	pthread_mutex_lock(&q->lock);
+	while(q->count == QUEUE_SIZE)
+		pthread_cond_wait(&q->not_full, &q->lock);
+	q->item[(q->head + q->count++) % QUEUE_SIZE] = j;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+struct job queue_pop(struct queue *q){
+	pthread_mutex_lock(&q->lock);
+	while(q->count == 0)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	struct job j = q->item[q->head];
+	q->head = (q->head + 1) % QUEUE_SIZE;
+	q->count--;
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+	return j;
+}
+
+/* Gray = (r+g+b)/3 of one truecolor pixel, keeping alpha */
+static inline unsigned int gray(unsigned int p){
+	unsigned int g = (((p >> 16) & 0xff) + ((p >> 8) & 0xff) + (p & 0xff)) / 3;
+	return (p & 0x7f000000) | g << 16 | g << 8 | g;
+}
+
+/* Gray over row-major tiles of 16 whole rows, OpenMP over the tiles */
+void gray_image(gdImagePtr img){
+	long w = gdImageSX(img), h = gdImageSY(img);
+	#pragma omp parallel for schedule(dynamic)
+	for(long y0 = 0; y0 < h; y0 += 16)
+		for(long y = y0; y < y0 + 16 && y < h; y++){
+			int *row = img->tpixels[y];
+			#pragma omp simd
+			for(long x = 0; x < w; x++)
+				row[x] = gray(row[x]);
+		}
+}
+
+char **names;
+int n_names, next_name, n_decoders, n_encoders;
+const char *in_dir, *out_dir;
+pthread_mutex_t name_lock = PTHREAD_MUTEX_INITIALIZER;
+struct queue decoded, filtered;
+double busy[3];	/* decode, filter, encode seconds summed over workers */
+pthread_mutex_t busy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void add_busy(int stage, double t){
+	pthread_mutex_lock(&busy_lock);
+	busy[stage] += t;
+	pthread_mutex_unlock(&busy_lock);
+}
+
+/* Decode workers take the next file name and queue its decoded image */
+void *decoder(void *arg){
+	(void)arg;
+	for(;;){
+		pthread_mutex_lock(&name_lock);
+		int k = next_name < n_names ? next_name++ : -1;
+		pthread_mutex_unlock(&name_lock);
+		if(k < 0)
+			break;
+		struct job j;
+		char path[2 * NAME_LEN];
+		snprintf(j.name, NAME_LEN, "%s", names[k]);
+		snprintf(path, sizeof(path), "%s/%s", in_dir, names[k]);
+		double t = omp_get_wtime();
+		FILE *fp = fopen(path, "rb");
+		j.img = fp ? gdImageCreateFromPng(fp) : NULL;
+		if(fp)
+			fclose(fp);
+		if(j.img == NULL){
+			fprintf(stderr, "Cannot decode %s\n", path);
+			continue;
+		}
+		gdImagePaletteToTrueColor(j.img);
+		add_busy(0, omp_get_wtime() - t);
+		queue_push(&decoded, j);
+	}
+	return NULL;
+}
+
+/* Encode workers write images until they get an end marker */
+void *encoder(void *arg){
+	long *done = arg;
+	for(;;){
+		struct job j = queue_pop(&filtered);
+		if(j.img == NULL)
+			break;
+		char path[2 * NAME_LEN];
+		snprintf(path, sizeof(path), "%s/%s", out_dir, j.name);
+		double t = omp_get_wtime();
+		FILE *fp = fopen(path, "wb");
+		if(fp){
+			gdImagePng(j.img, fp);
+			fclose(fp);
+			(*done)++;
+		}
+		else
+			fprintf(stderr, "Cannot write %s\n", path);
+		gdImageDestroy(j.img);
+		add_busy(2, omp_get_wtime() - t);
+	}
+	return NULL;
+}
+
+/* Joins the decoders, then queues the end marker for the filter stage */
+void *close_decoded(void *arg){
+	pthread_t *dec = arg;
+	for(int k=0; k<n_decoders; k++)
+		pthread_join(dec[k], NULL);
+	struct job end = {"", NULL};
+	queue_push(&decoded, end);
+	return NULL;
+}
+
+int is_png(const char *name){
+	size_t n = strlen(name);
+	return n > 4 && n < NAME_LEN && strcmp(name + n - 4, ".png") == 0;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc < 3){
+		printf("Usage: %s input-dir output-dir [decoders] [encoders]\n", argv[0]);
+		return 1;
+	}
+	in_dir = argv[1];
+	out_dir = argv[2];
+	n_decoders = argc > 3 ? atoi(argv[3]) : 2;
+	n_encoders = argc > 4 ? atoi(argv[4]) : 2;
+	if(n_decoders < 1 || n_encoders < 1){
+		printf("Need at least one decoder and one encoder\n");
+		return 1;
+	}
+	DIR *dir = opendir(in_dir);
+	if(dir == NULL){
+		perror(in_dir);
+		return 1;
+	}
+	struct dirent *e;
+	int cap = 16;
+	names = malloc(cap * sizeof(char*));
+	while((e = readdir(dir)) != NULL)
+		if(is_png(e->d_name)){
+			if(n_names == cap)
+				names = realloc(names, (cap *= 2) * sizeof(char*));
+			names[n_names++] = strdup(e->d_name);
+		}
+	closedir(dir);
+
+	queue_init(&decoded);
+	queue_init(&filtered);
+	pthread_t *dec = malloc(n_decoders * sizeof(pthread_t)), *enc = malloc(n_encoders * sizeof(pthread_t));
+	long *done = calloc(n_encoders, sizeof(long)), total = 0;
+	double t = omp_get_wtime();
+	for(int k=0; k<n_decoders; k++)
+		pthread_create(&dec[k], NULL, decoder, NULL);
+	for(int k=0; k<n_encoders; k++)
+		pthread_create(&enc[k], NULL, encoder, &done[k]);
+
+	/* The filter stage runs here, with the OpenMP team on each image,
+	   while decoders read ahead and encoders drain behind it. A helper
+	   thread marks the end of the decoded stream once the decoders exit. */
+	pthread_t closer;
+	pthread_create(&closer, NULL, close_decoded, dec);
+	for(;;){
+		struct job j = queue_pop(&decoded);
+		if(j.img == NULL)
+			break;
+		double s = omp_get_wtime();
+		gray_image(j.img);
+		add_busy(1, omp_get_wtime() - s);
+		queue_push(&filtered, j);
+	}
+	pthread_join(closer, NULL);
+	for(int k=0; k<n_encoders; k++){
+		struct job end = {"", NULL};
+		queue_push(&filtered, end);
+	}
+	for(int k=0; k<n_encoders; k++){
+		pthread_join(enc[k], NULL);
+		total += done[k];
+	}
+	t = omp_get_wtime() - t;
+
+	printf("%ld images in %.4fs: %.2f images/s\n", total, t, total / t);
+	printf("Busy seconds\tdecode %.4f (%d threads)\tfilter %.4f (%d threads)\tencode %.4f (%d threads)\n",
+		busy[0], n_decoders, busy[1], omp_get_max_threads(), busy[2], n_encoders);
+	for(int k=0; k<n_names; k++)
+		free(names[k]);
+	free(names);	free(dec);	free(enc);	free(done);
+	return 0;
+}
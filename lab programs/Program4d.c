@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gd.h>
+#include<omp.h>
+#define MAX_RADIUS 48
+#define MAX_TAPS (2 * MAX_RADIUS + 1)
+#define MAX_STAGES 16
+/* A tile plus its halo stays in L2 while both passes run over it */
+#define TILE_W 256
+#define TILE_H 64
+/* Outputs accumulated in registers at a time; TILE_W is a multiple */
+#define VEC 16
+/* Cost of one more sweep over memory, in multiply-adds per pixel; fusing
+   grows the kernels, so it only pays while it saves more than this */
+#define SWEEP_COST 32
+/* Taps at which a kernel costs twice as much per tap: long kernels spill
+   their accumulators and weights out of registers and L1 */
+#define TAP_SCALE 64
+/* Row-pass scratch a tile may use and still stay in L2 */
+#define TILE_CACHE (512 << 10)
+
+/* Separable kernel: row taps along x, then column taps along y */
+struct kernel {
+	int rx, ry;
+	float row[MAX_TAPS], col[MAX_TAPS];
+};
+
+/* One sweep over the image: out = c0 K0*in + c1 K1*in, or the gradient
+   magnitude sqrt((K0*in)^2 + (K1*in)^2) */
+struct pass {
+	int nk, magnitude;
+	float c[2];
+	struct kernel k[2];
+};
+
+struct kernel identity_kernel(void){
+	struct kernel k = {0, 0, {1}, {1}};
+	return k;
+}
+
+struct kernel gaussian_kernel(float sigma){
+	struct kernel k;
+	int r = (int)ceilf(3 * sigma);
+	float sum = 0;
+	k.rx = k.ry = r = r < MAX_RADIUS ? r : MAX_RADIUS;
+	for(int i=-r; i<=r; i++)
+		sum += k.row[i + r] = expf(-0.5f * i * i / (sigma * sigma));
+	for(int i=0; i<=2*r; i++)
+		k.col[i] = k.row[i] /= sum;
+	return k;
+}
+
+/* b applied after a, as one kernel: the row and column taps convolve */
+int compose(const struct kernel *a, const struct kernel *b, struct kernel *out){
+	struct kernel k;
+	k.rx = a->rx + b->rx;
+	k.ry = a->ry + b->ry;
+	if(k.rx > MAX_RADIUS || k.ry > MAX_RADIUS)
+		return 0;
+	memset(k.row, 0, sizeof(k.row));
+	memset(k.col, 0, sizeof(k.col));
+	for(int i=0; i<=2*a->rx; i++)
+		for(int j=0; j<=2*b->rx; j++)
+			k.row[i + j] += a->row[i] * b->row[j];
+	for(int i=0; i<=2*a->ry; i++)
+		for(int j=0; j<=2*b->ry; j++)
+			k.col[i + j] += a->col[i] * b->col[j];
+	*out = k;
+	return 1;
+}
+
+/* Widen a kernel to radii rx, ry with zero taps, so all kernels of a pass
+   share one halo */
+void pad_kernel(struct kernel *k, int rx, int ry){
+	struct kernel p = {0};
+	p.rx = rx;
+	p.ry = ry;
+	memcpy(p.row + rx - k->rx, k->row, (2 * k->rx + 1) * sizeof(float));
+	memcpy(p.col + ry - k->ry, k->col, (2 * k->ry + 1) * sizeof(float));
+	*k = p;
+}
+
+/* blur:<sigma>, sobel, unsharp:<sigma>:<amount> */
+int parse_stage(const char *s, struct pass *p){
+	float sigma, amount;
+	memset(p, 0, sizeof(*p));
+	if(sscanf(s, "blur:%f", &sigma) == 1 && sigma > 0){
+		p->nk = 1;
+		p->c[0] = 1;
+		p->k[0] = gaussian_kernel(sigma);
+	}
+	else if(strcmp(s, "sobel") == 0){
+		struct kernel gx = {1, 1, {-1, 0, 1}, {1, 2, 1}}, gy = {1, 1, {1, 2, 1}, {-1, 0, 1}};
+		p->nk = 2;
+		p->magnitude = 1;
+		p->k[0] = gx;
+		p->k[1] = gy;
+	}
+	else if(sscanf(s, "unsharp:%f:%f", &sigma, &amount) == 2 && sigma > 0){
+		/* in + amount (in - blur) */
+		p->nk = 2;
+		p->c[0] = 1 + amount;
+		p->c[1] = -amount;
+		p->k[0] = identity_kernel();
+		p->k[1] = gaussian_kernel(sigma);
+	}
+	else
+		return 0;
+	return 1;
+}
+
+/* Work of a pass per pixel and channel. The row pass also runs over the
+   2*ry halo rows of every tile, each tap gets dearer as the kernel
+   grows, and a pass whose row-pass scratch no longer fits in cache is
+   never worth making. */
+float pass_cost(const struct pass *p){
+	int rx = 0, ry = 0;
+	for(int i=0; i<p->nk; i++){
+		rx = p->k[i].rx > rx ? p->k[i].rx : rx;
+		ry = p->k[i].ry > ry ? p->k[i].ry : ry;
+	}
+	if((long)p->nk * (TILE_H + 2 * ry) * TILE_W * sizeof(float) > TILE_CACHE)
+		return INFINITY;
+	float halo = (float)(TILE_H + 2 * ry) / TILE_H;
+	float tx = 2 * rx + 1, ty = 2 * ry + 1;
+	return SWEEP_COST + p->nk * (tx * (1 + tx / TAP_SCALE) * halo
+		+ ty * (1 + ty / TAP_SCALE));
+}
+
+/* Try to merge pass next into cur so both run in one sweep. Everything
+   linear before a magnitude commutes with it: a plain blur can be folded
+   into the kernels of whatever follows it, and a blur that follows a
+   linear pass can be folded into that pass's kernels, as long as the
+   bigger kernels cost less than the sweep they save. */
+int fuse(struct pass *cur, const struct pass *next){
+	struct pass f;
+	if(!cur->magnitude && next->nk == 1){
+		f = *cur;
+		for(int i=0; i<f.nk; i++)
+			if(!compose(&cur->k[i], &next->k[0], &f.k[i]))
+				return 0;
+	}
+	else if(cur->nk == 1 && !cur->magnitude){
+		f = *next;
+		for(int i=0; i<f.nk; i++){
+			if(!compose(&cur->k[0], &next->k[i], &f.k[i]))
+				return 0;
+			f.c[i] = next->c[i] * (next->magnitude ? 1 : cur->c[0]);
+		}
+		if(next->magnitude)
+			for(int i=0; i<f.nk; i++)
+				for(int j=0; j<=2*f.k[i].rx; j++)
+					f.k[i].row[j] *= cur->c[0];
+	}
+	else
+		return 0;
+	if(pass_cost(&f) >= pass_cost(cur) + pass_cost(next))
+		return 0;
+	*cur = f;
+	return 1;
+}
+
+/* Fuse a chain of n stages into as few passes as pay; returns the count */
+int fuse_chain(const struct pass *stage, int n, struct pass *fused){
+	int n_fused = 1;
+	fused[0] = stage[0];
+	for(int i=1; i<n; i++)
+		if(!fuse(&fused[n_fused - 1], &stage[i]))
+			fused[n_fused++] = stage[i];
+	return n_fused;
+}
+
+static inline int clampi(int v, int lo, int hi){
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+/* Run one pass on the three planes. Threads take (tile, channel) pairs;
+   each tile is filtered along rows into a scratch block that includes ry
+   halo rows above and below, then down the columns of that block into
+   dst, so the source is read once per tile and the intermediate never
+   goes back to memory. */
+void run_pass(struct pass *p, float **src, float **dst, int w, int h){
+	int rx = 0, ry = 0;
+	for(int i=0; i<p->nk; i++){
+		rx = p->k[i].rx > rx ? p->k[i].rx : rx;
+		ry = p->k[i].ry > ry ? p->k[i].ry : ry;
+	}
+	for(int i=0; i<p->nk; i++)
+		pad_kernel(&p->k[i], rx, ry);
+	int nx = (w + TILE_W - 1) / TILE_W, ny = (h + TILE_H - 1) / TILE_H;
+	long block = (long)(TILE_H + 2 * ry) * TILE_W;
+	#pragma omp parallel
+	{
+		float *line = calloc(TILE_W + 2 * rx + VEC, sizeof(float));
+		float *tmp = malloc(p->nk * block * sizeof(float));
+		float *acc = malloc(2 * TILE_W * sizeof(float));
+		#pragma omp for schedule(dynamic)
+		for(long t=0; t<3L*nx*ny; t++){
+			int ch = t % 3, x0 = (int)(t / 3 % nx) * TILE_W, y0 = (int)(t / 3 / nx) * TILE_H;
+			int tw = w - x0 < TILE_W ? w - x0 : TILE_W, th = h - y0 < TILE_H ? h - y0 : TILE_H;
+			/* Row pass, halo rows and columns clamped to the border */
+			for(int r=0; r<th+2*ry; r++){
+				const float *row = src[ch] + (long)clampi(y0 + r - ry, 0, h - 1) * w;
+				if(x0 - rx >= 0 && x0 + tw + rx <= w)
+					memcpy(line, row + x0 - rx, (tw + 2 * rx) * sizeof(float));
+				else
+					for(int i=0; i<tw+2*rx; i++)
+						line[i] = row[clampi(x0 + i - rx, 0, w - 1)];
+				for(int k=0; k<p->nk; k++){
+					float *out = tmp + k * block + (long)r * TILE_W;
+					const float *taps = p->k[k].row;
+					for(int x=0; x<tw; x+=VEC){
+						float s[VEC] = {0};
+						for(int j=0; j<=2*rx; j++){
+							#pragma omp simd
+							for(int i=0; i<VEC; i++)
+								s[i] += taps[j] * line[x + j + i];
+						}
+						memcpy(out + x, s, sizeof(s));
+					}
+				}
+			}
+			/* Column pass and combine */
+			for(int r=0; r<th; r++){
+				for(int k=0; k<p->nk; k++){
+					float *a = acc + k * TILE_W;
+					const float *taps = p->k[k].col, *in = tmp + k * block + (long)r * TILE_W;
+					for(int x=0; x<tw; x+=VEC){
+						float s[VEC] = {0};
+						for(int j=0; j<=2*ry; j++){
+							#pragma omp simd
+							for(int i=0; i<VEC; i++)
+								s[i] += taps[j] * in[(long)j * TILE_W + x + i];
+						}
+						memcpy(a + x, s, sizeof(s));
+					}
+				}
+				float *o = dst[ch] + (long)(y0 + r) * w + x0;
+				if(p->magnitude){
+					#pragma omp simd
+					for(int x=0; x<tw; x++)
+						o[x] = sqrtf(acc[x] * acc[x] + acc[TILE_W + x] * acc[TILE_W + x]);
+				}
+				else if(p->nk == 2){
+					#pragma omp simd
+					for(int x=0; x<tw; x++)
+						o[x] = p->c[0] * acc[x] + p->c[1] * acc[TILE_W + x];
+				}
+				else{
+					#pragma omp simd
+					for(int x=0; x<tw; x++)
+						o[x] = p->c[0] * acc[x];
+				}
+			}
+		}
+		free(acc);	free(tmp);	free(line);
+	}
+}
+
+/* Run a chain of passes, ping-ponging between plane sets; the result ends
+   in out */
+double run_chain(struct pass *passes, int n, float **in, float **scratch, float **out, int w, int h){
+	float *a[3], *b[3];
+	double t = omp_get_wtime();
+	for(int i=0; i<n; i++){
+		for(int ch=0; ch<3; ch++){
+			a[ch] = i == 0 ? in[ch] : (n - i) % 2 ? scratch[ch] : out[ch];
+			b[ch] = (n - i) % 2 ? out[ch] : scratch[ch];
+		}
+		run_pass(&passes[i], a, b, w, h);
+	}
+	return omp_get_wtime() - t;
+}
+
+/* -b: each chain fused as the cost model decides against unfused, best of
+   three runs, on a synthetic image */
+int bench(int w, int h){
+	static const char *chains[][4] = {
+		{"blur:1", "blur:1"}, {"blur:1", "blur:1", "blur:1"}, {"blur:3", "blur:3"},
+		{"blur:3", "blur:3", "blur:3"}, {"blur:5", "blur:5"}, {"blur:1", "sobel"},
+		{"blur:3", "sobel"}, {"unsharp:2:1", "blur:1"}, {"blur:8", "unsharp:3:0.5"}
+	};
+	long n = (long)w * h;
+	float *plane[4][3];
+	for(int s=0; s<4; s++)
+		for(int ch=0; ch<3; ch++)
+			plane[s][ch] = malloc(n * sizeof(float));
+	#pragma omp parallel for
+	for(int y=0; y<h; y++)
+		for(int x=0; x<w; x++)
+			for(int ch=0; ch<3; ch++){
+				plane[0][ch][(long)y*w + x] = ((x ^ y) * (37 + ch)) & 0xff;
+				plane[1][ch][(long)y*w + x] = plane[2][ch][(long)y*w + x] = plane[3][ch][(long)y*w + x] = 0;
+			}
+	printf("%dx%d, %d threads\n", w, h, omp_get_max_threads());
+	printf("Chain\t\t\t\tPasses\tFused\t\tUnfused\n");
+	for(unsigned c=0; c<sizeof(chains)/sizeof(chains[0]); c++){
+		struct pass stage[4], fused[4];
+		char name[64] = "";
+		int n_stages = 0;
+		for(; n_stages<4 && chains[c][n_stages]; n_stages++){
+			parse_stage(chains[c][n_stages], &stage[n_stages]);
+			strcat(strcat(name, chains[c][n_stages]), " ");
+		}
+		int n_fused = fuse_chain(stage, n_stages, fused);
+		double best_f = INFINITY, best_u = INFINITY;
+		for(int rep=0; rep<3; rep++){
+			double f = run_chain(fused, n_fused, plane[0], plane[1], plane[2], w, h);
+			double u = run_chain(stage, n_stages, plane[0], plane[1], plane[3], w, h);
+			best_f = f < best_f ? f : best_f;
+			best_u = u < best_u ? u : best_u;
+		}
+		printf("%-32s%d/%d\t%.2fms\t%.2fms\n", name, n_fused, n_stages, best_f * 1000, best_u * 1000);
+	}
+	for(int s=0; s<4; s++)
+		for(int ch=0; ch<3; ch++)
+			free(plane[s][ch]);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct pass stage[MAX_STAGES], fused[MAX_STAGES];
+	int n_stages = 0, n_fused = 0, compare = 0;
+	if(argc > 1 && strcmp(argv[1], "-b") == 0){
+		int w = 2000, h = 2000;
+		if(argc > 2 && (sscanf(argv[2], "%dx%d", &w, &h) != 2 || w < 1 || h < 1)){
+			printf("Usage: %s -b [<width>x<height>]\n", argv[0]);
+			return 1;
+		}
+		return bench(w, h);
+	}
+	for(int a=3; a<argc; a++){
+		if(strcmp(argv[a], "-u") == 0)
+			compare = 1;
+		else if(n_stages == MAX_STAGES || !parse_stage(argv[a], &stage[n_stages++])){
+			n_stages = 0;
+			break;
+		}
+	}
+	if(argc < 4 || n_stages == 0){
+		printf("Usage: %s in.png out.png [-u] filter...\n"
+			"       %s -b [<width>x<height>]\n"
+			"Filters: blur:<sigma> sobel unsharp:<sigma>:<amount>\n"
+			"-u also runs the chain unfused and compares\n"
+			"-b times fused against unfused chains on a synthetic image\n", argv[0], argv[0]);
+		return 1;
+	}
+	n_fused = fuse_chain(stage, n_stages, fused);
+
+	FILE *fp = fopen(argv[1], "rb");
+	gdImagePtr img = fp ? gdImageCreateFromPng(fp) : NULL;
+	if(fp)
+		fclose(fp);
+	if(img == NULL){
+		printf("Cannot read %s\n", argv[1]);
+		return 1;
+	}
+	gdImagePaletteToTrueColor(img);
+	int w = gdImageSX(img), h = gdImageSY(img);
+	long n = (long)w * h;
+	float *plane[3][3];
+	for(int s=0; s<3; s++)
+		for(int ch=0; ch<3; ch++)
+			plane[s][ch] = malloc(n * sizeof(float));
+	/* Every plane is first touched by the threads, in row bands */
+	#pragma omp parallel for
+	for(int y=0; y<h; y++)
+		for(int x=0; x<w; x++){
+			unsigned int p = img->tpixels[y][x];
+			plane[1][0][(long)y*w + x] = plane[1][1][(long)y*w + x] = plane[1][2][(long)y*w + x] = 0;
+			plane[2][0][(long)y*w + x] = plane[2][1][(long)y*w + x] = plane[2][2][(long)y*w + x] = 0;
+			plane[0][0][(long)y*w + x] = (p >> 16) & 0xff;
+			plane[0][1][(long)y*w + x] = (p >> 8) & 0xff;
+			plane[0][2][(long)y*w + x] = p & 0xff;
+		}
+
+	printf("%dx%d, %d filters in %d passes, %d threads\n", w, h, n_stages, n_fused, omp_get_max_threads());
+	double t = run_chain(fused, n_fused, plane[0], plane[1], plane[2], w, h);
+	printf("Fused\t%.4fms\t%.1f MPixel/s\n", t * 1000, n / t * 1e-6);
+	if(compare){
+		/* The unfused chain writes its own output set */
+		float *ref[3];
+		for(int ch=0; ch<3; ch++)
+			ref[ch] = malloc(n * sizeof(float));
+		#pragma omp parallel for
+		for(int y=0; y<h; y++)
+			for(int ch=0; ch<3; ch++)
+				memset(ref[ch] + (long)y*w, 0, w * sizeof(float));
+		double u = run_chain(stage, n_stages, plane[0], plane[1], ref, w, h);
+		/* Fusing changes only how the border is clamped, so compare away
+		   from it */
+		int margin = 0;
+		for(int i=0; i<n_stages; i++)
+			margin += stage[i].k[0].rx > stage[i].k[0].ry ? stage[i].k[0].rx : stage[i].k[0].ry;
+		float err = 0;
+		for(int ch=0; ch<3; ch++)
+			for(int y=margin; y<h-margin; y++)
+				for(int x=margin; x<w-margin; x++){
+					float e = fabsf(ref[ch][(long)y*w + x] - plane[2][ch][(long)y*w + x]);
+					err = e > err ? e : err;
+				}
+		printf("Unfused\t%.4fms\t%.1f MPixel/s\tmax interior difference %.2e\n", u * 1000, n / u * 1e-6, err);
+		for(int ch=0; ch<3; ch++)
+			free(ref[ch]);
+	}
+
+	#pragma omp parallel for
+	for(int y=0; y<h; y++)
+		for(int x=0; x<w; x++){
+			int c[3];
+			for(int ch=0; ch<3; ch++){
+				float v = plane[2][ch][(long)y*w + x] + 0.5f;
+				c[ch] = v < 0 ? 0 : v > 255 ? 255 : (int)v;
+			}
+			img->tpixels[y][x] = (img->tpixels[y][x] & 0x7f000000) | c[0] << 16 | c[1] << 8 | c[2];
+		}
+	fp = fopen(argv[2], "wb");
+	if(fp == NULL){
+		printf("Cannot write %s\n", argv[2]);
+		return 1;
+	}
+	gdImagePng(img, fp);
+	fclose(fp);
+	gdImageDestroy(img);
+	for(int s=0; s<3; s++)
+		for(int ch=0; ch<3; ch++)
+			free(plane[s][ch]);
+	return 0;
+}
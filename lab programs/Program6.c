@@ -1,73 +1,409 @@
 #include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
 #include<omp.h>
 #include<ctype.h>
 #include<string.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
 #define COUNT 10
+#define TABLE_SIZE 32	/* power of two, at least 2*COUNT */
+#define FOLD_BLOCK (1 << 16)	/* bytes folded at a time; longer words split */
+#define ARENA_CHUNK (1 << 20)
+#define PARTITIONS 64	/* merge partitions, by the top hash bits */
 
 char search_words[20][COUNT] = {"The","around","graphics","from","by","be","a","which","various","mount"};
 long counts[COUNT];
+int key_len[COUNT];
+unsigned char fold[256];	/* lower-case letter, or 0 for a non-letter */
+int table[TABLE_SIZE];	/* keyword in each slot, -1 if none */
+uint32_t seed;
 
-int is_equal(char* a,const char* key, int ignore_case){
+/* Case-insensitive hash of a word to a table slot */
+static inline uint32_t word_hash(const unsigned char *w, long len, uint32_t s){
+	uint32_t h = s ^ (uint32_t)len * 0x9e3779b9u;
+	for(long i=0; i<len; i++)
+		h = (h ^ fold[w[i]]) * 0x01000193u;
+	h ^= h >> 16;
+	return h & (TABLE_SIZE - 1);
+}
+
+/* Perfect hash for the keywords: try seeds until each one gets a slot of
+   its own, so a lookup is one hash and at most one comparison */
+void build_table(void){
+	for(int c=0; c<256; c++)
+		fold[c] = isalpha(c) ? tolower(c) : 0;
+	for(int i=0; i<COUNT; i++)
+		key_len[i] = strlen(search_words[i]);
+	for(seed=1; ; seed++){
+		int ok = 1;
+		for(int s=0; s<TABLE_SIZE; s++)
+			table[s] = -1;
+		for(int i=0; i<COUNT && ok; i++){
+			uint32_t slot = word_hash((unsigned char*)search_words[i], key_len[i], seed);
+			if(table[slot] >= 0)
+				ok = 0;
+			table[slot] = i;
+		}
+		if(ok)
+			return;
+	}
+}
+
+/* Keyword index of a word, or -1 */
+static inline int lookup(const unsigned char *w, long len){
+	int k = table[word_hash(w, len, seed)];
+	if(k < 0 || key_len[k] != len)
+		return -1;
+	for(long i=0; i<len; i++)
+		if(fold[w[i]] != fold[(unsigned char)search_words[k][i]])
+			return -1;
+	return k;
+}
+
+/* Map a whole file read-only; NULL on error. An empty file maps to an
+   empty buffer that need not be unmapped. */
+const unsigned char *map_file(const char *file_name, long *size){
+	static const unsigned char empty[1];
+	int fd = open(file_name, O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0){
+		perror(file_name);
+		if(fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	*size = st.st_size;
+	if(*size == 0){
+		close(fd);
+		return empty;
+	}
+	const unsigned char *buf = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(buf == MAP_FAILED){
+		perror(file_name);
+		return NULL;
+	}
+	madvise((void*)buf, *size, MADV_SEQUENTIAL);
+	return buf;
+}
+
+void unmap_file(const unsigned char *buf, long size){
+	if(size > 0)
+		munmap((void*)buf, size);
+}
+
+/* Start of thread id's share of the file: its equal byte range, moved past
+   a word that straddles the range start. That word belongs to the thread
+   before, which reads past its own end to finish it. */
+static long range_start(const unsigned char *buf, long size, int id, int nt){
+	long i = size * id / nt;
+	while(i > 0 && i < size && fold[buf[i-1]] && fold[buf[i]])
+		i++;
+	return i;
+}
+
+/* Count every keyword, ignoring case, in one pass over the mapped file,
+   with each thread scanning its own byte range */
+int count_keywords(const char *file_name, int threads){
+	long size;
+	const unsigned char *buf = map_file(file_name, &size);
+	memset(counts, 0, sizeof(counts));
+	if(buf == NULL)
+		return -1;
+	#pragma omp parallel num_threads(threads)
+	{
+		long local[COUNT] = {0};
+		int nt = omp_get_num_threads(), id = omp_get_thread_num();
+		long i = range_start(buf, size, id, nt), hi = size * (id + 1) / nt;
+		while(i < hi){
+			while(i < hi && !fold[buf[i]])
+				i++;
+			if(i >= hi)
+				break;
+			long start = i;
+			while(i < size && fold[buf[i]])
+				i++;
+			int k = lookup(buf + start, i - start);
+			if(k >= 0)
+				local[k]++;
+		}
+		#pragma omp critical
+		for(int k=0; k<COUNT; k++)
+			counts[k] += local[k];
+	}
+	unmap_file(buf, size);
+	return 0;
+}
+
+/* Word strings live in chunks that never move, so table entries can point
+   into them and the merged tables can share them without copying */
+struct chunk {
+	struct chunk *prev;
+	char data[];
+};
+struct arena {
+	struct chunk *last;
+	char *next;
+	long left;
+};
+
+char *arena_copy(struct arena *a, const unsigned char *w, long len){
+	if(len > a->left){
+		long size = len > ARENA_CHUNK ? len : ARENA_CHUNK;
+		struct chunk *c = malloc(sizeof(struct chunk) + size);
+		c->prev = a->last;
+		a->last = c;
+		a->next = c->data;
+		a->left = size;
+	}
+	char *p = a->next;
+	memcpy(p, w, len);
+	a->next += len;
+	a->left -= len;
+	return p;
+}
+
+void arena_free(struct arena *a){
+	while(a->last){
+		struct chunk *c = a->last;
+		a->last = c->prev;
+		free(c);
+	}
+}
+
+/* Open-addressing word table with linear probing, kept at most half full */
+struct entry {
+	uint64_t hash;
+	const char *word;
+	long len, count;
+};
+struct table {
+	struct entry *slot;
+	long mask, used;
+};
 
-	int len_a = strlen(a),len_b = strlen(key);
-	if(len_a != len_b)
-		return 0;
-	if(ignore_case)
-		return strcasecmp(a,key)==0;
-	return strcmp(a,key)==0;
+void table_init(struct table *t, long cap){
+	t->slot = calloc(cap, sizeof(struct entry));
+	t->mask = cap - 1;
+	t->used = 0;
 }
 
-void read_word(char *temp, FILE *fp){
-	int i=0;
-	char ch;
-	while((ch = fgetc(fp)) != EOF && isalpha(ch) == 0){	}
-	while(ch != EOF	&&isalpha(ch) != 0){
-		temp[i++] = ch;
-		ch = fgetc(fp);
+static inline struct entry *table_find(const struct table *t, uint64_t h, const char *w, long len){
+	for(long s = h & t->mask; ; s = (s + 1) & t->mask){
+		struct entry *e = &t->slot[s];
+		if(e->word == NULL || (e->hash == h && e->len == len && memcmp(e->word, w, len) == 0))
+			return e;
 	}
-	temp[i] = '\0';
-}
-
-long determine_count(const char *file_name, const char *key, int ignore_case)
-{
-	int key_index=0,key_len = strlen(key);
-	long word_count=0;
-	char ch;
-	FILE *fp = fopen(file_name,"r");
-	char temp[40];
-	int i=0;
-	while(feof(fp) == 0){
-	read_word(temp,fp);
-	if(is_equal(temp,key,ignore_case) != 0)
-		word_count++;
-    }
-	return word_count;
-}
-int main(){
-	char output[1000]="";
+}
+
+void table_grow(struct table *t){
+	struct table bigger;
+	table_init(&bigger, 2 * (t->mask + 1));
+	for(long s=0; s<=t->mask; s++)
+		if(t->slot[s].word)
+			*table_find(&bigger, t->slot[s].hash, t->slot[s].word, t->slot[s].len) = t->slot[s];
+	bigger.used = t->used;
+	free(t->slot);
+	*t = bigger;
+}
+
+/* Add n to a word's count. A new word is copied into the arena when one
+   is given, and otherwise shares the caller's string. */
+static inline void table_add(struct table *t, struct arena *a, uint64_t h, const char *w, long len, long n){
+	if(2 * (t->used + 1) > t->mask + 1)
+		table_grow(t);
+	struct entry *e = table_find(t, h, w, len);
+	if(e->word == NULL){
+		e->hash = h;
+		e->word = a ? arena_copy(a, (const unsigned char*)w, len) : w;
+		e->len = len;
+		e->count = 0;
+		t->used++;
+	}
+	e->count += n;
+}
+
+/* Lower-case ASCII letters and zero everything else, branch-free so it
+   runs in SIMD over a whole block */
+static void fold_block(const unsigned char *in, unsigned char *out, long n){
+	#pragma omp simd
+	for(long i=0; i<n; i++){
+		unsigned char l = in[i] | 0x20;
+		out[i] = (unsigned char)(l - 'a') < 26 ? l : 0;
+	}
+}
+
+static inline uint64_t folded_hash(const unsigned char *w, long len){
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(long i=0; i<len; i++)
+		h = (h ^ w[i]) * 0x100000001b3ULL;
+	h ^= h >> 32;
+	h *= 0xd6e8feb86659fd93ULL;
+	return h ^ (h >> 32);
+}
+
+static inline int partition_of(uint64_t h){
+	return h >> 58;
+}
+
+static int by_count(const void *a, const void *b){
+	const struct entry *x = a, *y = b;
+	if(x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	long n = x->len < y->len ? x->len : y->len;
+	int c = n ? memcmp(x->word, y->word, n) : 0;
+	return c ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+/* Full word-frequency histogram of a file, case-insensitive, printing the
+   top_n words. Threads fold and tokenize their byte ranges into private
+   tables, bin their entries by partition, then each partition is merged
+   from all threads' bins by one thread, which also picks its top_n. */
+int word_histogram(const char *file_name, int threads, int top_n, int print){
+	long size;
+	const unsigned char *buf = map_file(file_name, &size);
+	if(buf == NULL)
+		return -1;
+	struct table local[threads], merged[PARTITIONS];
+	struct arena arena[threads];
+	struct entry **bin[threads];
+	long start[threads][PARTITIONS + 1];
+	struct entry *cand = calloc((long)PARTITIONS * top_n, sizeof(struct entry));
+	long total = 0, distinct = 0;
+	int nt = 1;
+	#pragma omp parallel num_threads(threads) reduction(+:total)
+	{
+		int id = omp_get_thread_num();
+		#pragma omp single
+		nt = omp_get_num_threads();
+		long i = range_start(buf, size, id, nt), hi = size * (id + 1) / nt;
+		struct table *t = &local[id];
+		unsigned char block[FOLD_BLOCK];
+		table_init(t, 1 << 12);
+		memset(&arena[id], 0, sizeof(struct arena));
+		/* Fold a block, count the words that end inside it, and start the
+		   next block at a word cut off by the block end */
+		while(i < hi){
+			long n = size - i < FOLD_BLOCK ? size - i : FOLD_BLOCK, j = 0, next = i + n;
+			fold_block(buf + i, block, n);
+			while(j < n){
+				while(j < n && !block[j])
+					j++;
+				if(j == n)
+					break;
+				if(i + j >= hi){
+					next = hi;
+					break;
+				}
+				long s = j;
+				while(j < n && block[j])
+					j++;
+				if(j == n && i + n < size && s > 0){
+					next = i + s;
+					break;
+				}
+				table_add(t, &arena[id], folded_hash(block + s, j - s), (const char*)block + s, j - s, 1);
+				total++;
+			}
+			i = next;
+		}
+		/* Bin this thread's entries by partition, a counting sort */
+		long *st = start[id];
+		memset(st, 0, sizeof(start[id]));
+		for(long s=0; s<=t->mask; s++)
+			if(t->slot[s].word)
+				st[partition_of(t->slot[s].hash) + 1]++;
+		for(int p=0; p<PARTITIONS; p++)
+			st[p + 1] += st[p];
+		long fill[PARTITIONS];
+		memcpy(fill, st, sizeof(fill));
+		bin[id] = malloc(sizeof(struct entry*) * (t->used + 1));
+		for(long s=0; s<=t->mask; s++)
+			if(t->slot[s].word)
+				bin[id][fill[partition_of(t->slot[s].hash)]++] = &t->slot[s];
+		#pragma omp barrier
+		#pragma omp for schedule(dynamic) reduction(+:distinct)
+		for(int p=0; p<PARTITIONS; p++){
+			struct table *m = &merged[p];
+			table_init(m, 1 << 10);
+			for(int k=0; k<nt; k++)
+				for(long e=start[k][p]; e<start[k][p + 1]; e++)
+					table_add(m, NULL, bin[k][e]->hash, bin[k][e]->word, bin[k][e]->len, bin[k][e]->count);
+			distinct += m->used;
+			/* Top top_n of the partition, kept sorted by insertion */
+			struct entry *top = cand + (long)p * top_n;
+			int have = 0;
+			for(long s=0; s<=m->mask; s++){
+				struct entry *e = &m->slot[s];
+				if(e->word == NULL || (have == top_n && by_count(e, &top[have - 1]) >= 0))
+					continue;
+				int pos = have < top_n ? have++ : top_n - 1;
+				while(pos > 0 && by_count(e, &top[pos - 1]) < 0){
+					top[pos] = top[pos - 1];
+					pos--;
+				}
+				top[pos] = *e;
+			}
+		}
+	}
+	qsort(cand, (long)PARTITIONS * top_n, sizeof(struct entry), by_count);
+	if(print){
+		printf("%ld words, %ld distinct\n", total, distinct);
+		for(int k=0; k<top_n && cand[k].word; k++)
+			printf("%8ld  %.*s\n", cand[k].count, (int)cand[k].len, cand[k].word);
+	}
+	for(int p=0; p<PARTITIONS; p++)
+		free(merged[p].slot);
+	for(int k=0; k<nt; k++){
+		free(local[k].slot);
+		free(bin[k]);
+		arena_free(&arena[k]);
+	}
+	free(cand);
+	unmap_file(buf, size);
+	return 0;
+}
+
+int main(int argc, char **argv){
+	char output[1000]="", *o = output;
 	int i;
-	for(i=0;i<COUNT;i++)
-		counts[i] = 0;
+	build_table();
+	/* -w file [top-N]: word-frequency histogram instead of the keywords */
+	if(argc > 2 && strcmp(argv[1], "-w") == 0){
+		int top_n = argc > 3 ? atoi(argv[3]) : 20;
+		if(top_n < 1)
+			top_n = 20;
+		printf("Threads\tTime\n");
+		for(int t=1; t<=8; t*=2){
+			double start = omp_get_wtime();
+			if(word_histogram(argv[2], t, top_n, 0) != 0)
+				return 1;
+			printf("%d\t%lfs\n", t, omp_get_wtime() - start);
+		}
+		return word_histogram(argv[2], omp_get_max_threads(), top_n, 1);
+	}
 	char* my_files[4]={"file1.txt","file2.txt","file3.txt","file4.txt"};
-	sprintf(output,"  Size\t\tT1\t\tT2\t\tT4\t\tT8\n");
+	o += sprintf(o,"  Size\t\tT1\t\tT2\t\tT4\t\tT8\n");
 	for(int iter=0; iter<4; iter++){
-		FILE *fp = fopen(my_files[iter],"r");
-		fseek(fp, 0L, SEEK_END);
-		printf("\nFile size: %.2lfKB\n",ftell(fp)/1024.0);
-		sprintf(output,"%s%7.2lfKB\t",output,ftell(fp)/1024.0);
-		fclose(fp);
+		struct stat st;
+		if(stat(my_files[iter], &st) != 0){
+			perror(my_files[iter]);
+			continue;
+		}
+		printf("\nFile size: %.2lfKB\n",st.st_size/1024.0);
+		o += sprintf(o,"%7.2lfKB\t",st.st_size/1024.0);
 		for(int t=1; t<=8; t*=2){
-			omp_set_num_threads(t);
 			double start = omp_get_wtime();
-			#pragma omp parallel for
-			for(i=0;i<COUNT;i++)
-				counts[i] = determine_count(my_files[iter],search_words[i],1);
+			count_keywords(my_files[iter], t);
 			double time = omp_get_wtime() - start;
-			sprintf(output,"%s%lfs\t",output,time);
+			o += sprintf(o,"%lfs\t",time);
 		}
 		for(i=0;i<COUNT;i++)
 				printf("%s: %ld  ",search_words[i],counts[i]);
-		sprintf(output,"%s\n",output);
+		o += sprintf(o,"\n");
 	}
 	printf("\n");
 	puts(output);
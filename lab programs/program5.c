@@ -1,62 +1,506 @@
 #include<stdio.h>
 #include<stdlib.h>
+#include<stdint.h>
+#include<string.h>
 #include<omp.h>
 #include<math.h>
-#define CLUSTER_SIZE 4
+#define SEED 3655942
+#define BLOCK 256
+#define TOL 1e-3f
+/* Elkan's n*k lower bounds are skipped for sizes beyond this */
+#define ELKAN_MAX_BYTES (1L << 31)
 
-int cluster[CLUSTER_SIZE][2] = {{75, 25}, {25, 25}, {25, 75}, {75, 75}};
-long long cluster_count[CLUSTER_SIZE];
-unsigned long points_sizes[6]={100000,500000,1000000,5000000,10000000};
-short points[10000000][2];
+unsigned long points_sizes[5]={100000,500000,1000000,5000000,10000000};
 char output[10000]="";
 
-void populate_points(unsigned long long size) {
-	long long i;
-	for(i = 0; i < size; i++) {
-		srand(i);
-		points[i][0] = rand() % 100;
-		points[i][1] = rand() % 100;
+/* Counter-based generator: value i depends only on i, so any thread can
+   fill any range and the data never depends on the thread count */
+static inline uint64_t mix64(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline float uniform(uint64_t key) {
+	return (mix64(key) >> 40) * (1.0f / 16777216.0f);
+}
+
+/* Points are stored SoA: coordinate d of point i is x[d*n + i]. Each point
+   lies around one of k blob centres in [0, 100)^dims. */
+void populate_points(float *x, long n, int k, int dims) {
+	long i;
+	#pragma omp parallel for schedule(static)
+	for(i = 0; i < n; i++) {
+		uint64_t blob = mix64(SEED + i) % k;
+		for(int d = 0; d < dims; d++) {
+			float centre = 100 * uniform(SEED ^ ((blob * dims + d + 1) << 40));
+			uint64_t key = (1ULL << 62) + (((uint64_t)i * dims + d) << 1);
+			x[d*n + i] = centre + 8 * (uniform(key) + uniform(key + 1) - 1);
+		}
 	}
 }
 
-double get_distance(int x1,  int y1,  int x2,  int y2) {
-	int x = x2-x1, y = y2-y1;
-	return (double)sqrt((x * x) + (y * y));
+/* Deterministic start: every (n/k)-th point is a centroid */
+void init_centroids(const float *x, long n, int k, int dims, float *c) {
+	for(int j = 0; j < k; j++)
+		for(int d = 0; d < dims; d++)
+			c[j*dims + d] = x[d*n + j * (n / k)];
 }
 
-int main() {
-	double t;
-	sprintf(output,"Size\t\tT1\tT2\tT4\tT8\n");
-	for(int index=0; index<5; index++){
-		printf("Size: %ld",points_sizes[index]);
-		sprintf(output,"%s%8ld\t",output,points_sizes[index]);
-		populate_points(points_sizes[index]);
-		unsigned long long i;
-		for(int nt=1;nt<9;nt*=2){
-			for(i = 0; i < CLUSTER_SIZE; i++)
-				cluster_count[i] = 0;
-			t = omp_get_wtime();
-			#pragma omp parallel for reduction(+:cluster_count) num_threads(nt)
-			for(i = 0; i < points_sizes[index]; i++) {
-				double min_dist = 100, cur_dist = -1;
-				int j, cluster_index = -1;
-				for(j = 0; j < CLUSTER_SIZE; j++) {
-					cur_dist = get_distance(points[i][0], points[i][1], cluster[j][0], cluster[j][1]);
-					if(cur_dist < min_dist) {
-						min_dist = cur_dist;
-						cluster_index = j;
+/* New centroids from the sums; an empty cluster keeps its old centroid.
+   Stores how far each centroid moved in delta (if given) and returns the
+   largest squared move. */
+float move_centroids(const double *sum, const long *count, int k, int dims, float *c, float *delta) {
+	float move = 0;
+	for(int j = 0; j < k; j++) {
+		float m = 0;
+		if(count[j] > 0)
+			for(int d = 0; d < dims; d++) {
+				float v = sum[j*dims + d] / count[j];
+				m += (v - c[j*dims + d]) * (v - c[j*dims + d]);
+				c[j*dims + d] = v;
+			}
+		if(delta)
+			delta[j] = sqrtf(m);
+		move = m > move ? m : move;
+	}
+	return move;
+}
+
+/* Lloyd's algorithm on centroids c[j*dims + d] until no point changes
+   cluster, no centroid moves by TOL, or max_iter passes. Distances are
+   squared, computed for a block of BLOCK points against one centroid at a
+   time so the inner loops run along contiguous coordinates in SIMD. Each
+   thread accumulates centroid sums and counts privately and merges them
+   once per pass. */
+int kmeans_lloyd(const float *x, long n, int dims, int k, float *c, int *label,
+		int max_iter, int threads, long *count, long *evals) {
+	double *sum = malloc(sizeof(double) * k * dims);
+	int iter;
+	for(iter = 0; iter < max_iter; ) {
+		long changed = 0;
+		memset(sum, 0, sizeof(double) * k * dims);
+		memset(count, 0, sizeof(long) * k);
+		#pragma omp parallel num_threads(threads) reduction(+:changed)
+		{
+			double *lsum = calloc(k * dims, sizeof(double));
+			long *lcount = calloc(k, sizeof(long));
+			float best[BLOCK], dist[BLOCK];
+			int bestj[BLOCK];
+			long b;
+			#pragma omp for schedule(static)
+			for(b = 0; b < n; b += BLOCK) {
+				int m = n - b < BLOCK ? n - b : BLOCK;
+				for(int i = 0; i < m; i++) {
+					best[i] = INFINITY;
+					bestj[i] = 0;
+				}
+				for(int j = 0; j < k; j++) {
+					memset(dist, 0, sizeof(dist));
+					for(int d = 0; d < dims; d++) {
+						const float *xd = x + d*n + b;
+						float cd = c[j*dims + d];
+						#pragma omp simd
+						for(int i = 0; i < m; i++)
+							dist[i] += (xd[i] - cd) * (xd[i] - cd);
 					}
+					#pragma omp simd
+					for(int i = 0; i < m; i++)
+						if(dist[i] < best[i]) {
+							best[i] = dist[i];
+							bestj[i] = j;
+						}
+				}
+				for(int i = 0; i < m; i++) {
+					int j = bestj[i];
+					changed += label[b + i] != j;
+					label[b + i] = j;
+					lcount[j]++;
+					for(int d = 0; d < dims; d++)
+						lsum[j*dims + d] += x[d*n + b + i];
 				}
-				cluster_count[cluster_index]++;
 			}
+			#pragma omp critical
+			{
+				for(int j = 0; j < k * dims; j++)
+					sum[j] += lsum[j];
+				for(int j = 0; j < k; j++)
+					count[j] += lcount[j];
+			}
+			free(lsum);
+			free(lcount);
+		}
+		iter++;
+		if(move_centroids(sum, count, k, dims, c, NULL) < TOL * TOL || changed == 0)
+			break;
+	}
+	free(sum);
+	*evals = (long)iter * n * k;
+	return iter;
+}
+
+/* Move point i from cluster from (none if negative) to cluster to in a
+   thread's changes to the centroid sums and counts */
+static inline void relabel(const float *x, long n, int dims, long i, int from, int to,
+		double *lsum, long *lcount) {
+	if(from >= 0) {
+		lcount[from]--;
+		for(int d = 0; d < dims; d++)
+			lsum[from*dims + d] -= x[d*n + i];
+	}
+	lcount[to]++;
+	for(int d = 0; d < dims; d++)
+		lsum[to*dims + d] += x[d*n + i];
+}
+
+/* Add a thread's changes into the shared sums and counts and free them */
+void merge_changes(double *lsum, long *lcount, double *sum, long *count, int k, int dims) {
+	#pragma omp critical
+	{
+		for(int j = 0; j < k * dims; j++)
+			sum[j] += lsum[j];
+		for(int j = 0; j < k; j++)
+			count[j] += lcount[j];
+	}
+	free(lsum);
+	free(lcount);
+}
+
+static inline float distance(const float *p, const float *cj, int dims) {
+	float s = 0;
+	for(int d = 0; d < dims; d++)
+		s += (p[d] - cj[d]) * (p[d] - cj[d]);
+	return sqrtf(s);
+}
+
+/* Squared distances from p to all k centroids, with the centroids
+   transposed in ct[d*k + j] so the loop runs across centroids in SIMD */
+static inline void sq_distances(const float *p, const float *ct, int k, int dims, float *dist) {
+	#pragma omp simd
+	for(int j = 0; j < k; j++)
+		dist[j] = 0;
+	for(int d = 0; d < dims; d++) {
+		#pragma omp simd
+		for(int j = 0; j < k; j++)
+			dist[j] += (p[d] - ct[d*k + j]) * (p[d] - ct[d*k + j]);
+	}
+}
+
+static inline void all_distances(const float *p, const float *ct, int k, int dims, float *dist) {
+	sq_distances(p, ct, k, dims, dist);
+	#pragma omp simd
+	for(int j = 0; j < k; j++)
+		dist[j] = sqrtf(dist[j]);
+}
+
+/* Smallest of the k values v[j] other than v[a]; a = -1 takes them all */
+static inline float min_other(const float *v, int k, int a) {
+	float m = INFINITY;
+	#pragma omp simd reduction(min:m)
+	for(int j = 0; j < k; j++)
+		m = j != a && v[j] < m ? v[j] : m;
+	return m;
+}
+
+/* Centroid-to-centroid distances cc[j*k + j'], half the distance from each
+   centroid to its nearest other one in s[j], and the transposed copy ct */
+void centroid_gaps(const float *c, int k, int dims, float *cc, float *s, float *ct) {
+	for(int j = 0; j < k; j++)
+		for(int d = 0; d < dims; d++)
+			ct[d*k + j] = c[j*dims + d];
+	for(int j = 0; j < k; j++) {
+		s[j] = INFINITY;
+		for(int j2 = 0; j2 < k; j2++) {
+			cc[j*k + j2] = distance(c + j*dims, c + j2*dims, dims);
+			if(j2 != j && cc[j*k + j2] / 2 < s[j])
+				s[j] = cc[j*k + j2] / 2;
+		}
+	}
+}
+
+/* The largest centroid move, whose centroid it is, and the second largest:
+   how far a bound on the distance to the nearest other centroid can drop */
+void largest_moves(const float *delta, int k, int *jmax, float *dmax, float *dsecond) {
+	*jmax = 0;
+	*dmax = *dsecond = 0;
+	for(int j = 0; j < k; j++)
+		if(delta[j] > *dmax) {
+			*dsecond = *dmax;
+			*dmax = delta[j];
+			*jmax = j;
+		}
+		else if(delta[j] > *dsecond)
+			*dsecond = delta[j];
+}
+
+/* Hamerly's algorithm: one upper bound on the distance to the assigned
+   centroid and one lower bound on the distance to any other. A point is
+   skipped when its upper bound is below both the lower bound and half the
+   gap to the nearest other centroid; otherwise its upper bound is
+   tightened, and only if that fails are all k distances computed. After
+   each update the bounds move by how far the centroids moved, applied as
+   each point is visited, and the centroid sums are only corrected for the
+   points that changed cluster. Gives the same clusters as Lloyd's
+   algorithm. */
+int kmeans_hamerly(const float *x, long n, int dims, int k, float *c, int *label,
+		int max_iter, int threads, long *count, long *evals) {
+	double *sum = malloc(sizeof(double) * k * dims);
+	float *up = malloc(sizeof(float) * n), *lo = malloc(sizeof(float) * n);
+	float *cc = malloc(sizeof(float) * k * k), *s = malloc(sizeof(float) * k);
+	float *ct = malloc(sizeof(float) * k * dims), *delta = malloc(sizeof(float) * k);
+	long ev = 0;
+	int iter, jmax = 0;
+	float dmax = 0, dsecond = 0;
+	memset(sum, 0, sizeof(double) * k * dims);
+	memset(count, 0, sizeof(long) * k);
+	centroid_gaps(c, k, dims, cc, s, ct);
+	for(iter = 0; iter < max_iter; ) {
+		long changed = 0;
+		#pragma omp parallel num_threads(threads) reduction(+:changed,ev)
+		{
+			double *lsum = calloc(k * dims, sizeof(double));
+			long *lcount = calloc(k, sizeof(long));
+			float p[dims], dist[k];
+			long i;
+			#pragma omp for schedule(static)
+			for(i = 0; i < n; i++) {
+				int a = label[i];
+				float m = 0;
+				if(iter) {
+					/* The largest move loosens every lower bound, except
+					   for points assigned to that centroid, which only see
+					   the second largest */
+					up[i] += delta[a];
+					lo[i] -= a == jmax ? dsecond : dmax;
+					m = lo[i] > s[a] ? lo[i] : s[a];
+					if(up[i] <= m)
+						continue;
+				}
+				for(int d = 0; d < dims; d++)
+					p[d] = x[d*n + i];
+				if(iter) {
+					up[i] = distance(p, c + a*dims, dims);
+					ev++;
+					if(up[i] <= m)
+						continue;
+				}
+				sq_distances(p, ct, k, dims, dist);
+				ev += k;
+				/* Nearest and second nearest as SIMD minimums rather than
+				   one branchy scan, taking square roots of those two only */
+				float d1 = min_other(dist, k, -1);
+				int j1 = 0;
+				while(dist[j1] != d1)
+					j1++;
+				float d2 = min_other(dist, k, j1);
+				if(j1 != a) {
+					relabel(x, n, dims, i, a, j1, lsum, lcount);
+					changed++;
+					label[i] = j1;
+				}
+				up[i] = sqrtf(d1);
+				lo[i] = sqrtf(d2);
+			}
+			merge_changes(lsum, lcount, sum, count, k, dims);
+		}
+		iter++;
+		float move = move_centroids(sum, count, k, dims, c, delta);
+		if(move < TOL * TOL || changed == 0)
+			break;
+		largest_moves(delta, k, &jmax, &dmax, &dsecond);
+		centroid_gaps(c, k, dims, cc, s, ct);
+	}
+	*evals = ev;
+	free(sum);	free(up);	free(lo);	free(cc);	free(s);	free(ct);	free(delta);
+	return iter;
+}
+
+/* Elkan's algorithm: a lower bound per point and centroid, so besides the
+   Hamerly test each candidate centroid j can be ruled out on its own when
+   the upper bound is below its lower bound or half the gap between it and
+   the assigned centroid. Needs n*k floats of bounds. The smallest of a
+   point's lower bounds is also kept as Hamerly's single bound, so most
+   points are skipped without touching their k bounds, which are only
+   brought up to date by the centroid moves since they were last examined
+   when the point next gets past that test. */
+int kmeans_elkan(const float *x, long n, int dims, int k, float *c, int *label,
+		int max_iter, int threads, long *count, long *evals) {
+	double *sum = malloc(sizeof(double) * k * dims);
+	float *up = malloc(sizeof(float) * n), *lo = malloc(sizeof(float) * n * k);
+	float *lmin = malloc(sizeof(float) * n);
+	float *cc = malloc(sizeof(float) * k * k), *s = malloc(sizeof(float) * k);
+	float *ct = malloc(sizeof(float) * k * dims), *delta = malloc(sizeof(float) * k);
+	/* drift[t*k + j]: how far centroid j has moved over the first t
+	   updates; seen[i]: the update the bounds of point i are valid for */
+	double *drift = calloc((long)(max_iter + 1) * k, sizeof(double));
+	int *seen = calloc(n, sizeof(int));
+	long ev = 0;
+	int iter, jmax = 0;
+	float dmax = 0, dsecond = 0;
+	memset(sum, 0, sizeof(double) * k * dims);
+	memset(count, 0, sizeof(long) * k);
+	centroid_gaps(c, k, dims, cc, s, ct);
+	for(iter = 0; iter < max_iter; ) {
+		long changed = 0;
+		long i;
+		#pragma omp parallel num_threads(threads) reduction(+:changed,ev)
+		{
+			double *lsum = calloc(k * dims, sizeof(double));
+			long *lcount = calloc(k, sizeof(long));
+			float p[dims];
+			#pragma omp for schedule(static)
+			for(i = 0; i < n; i++) {
+				int a = label[i];
+				float *l = lo + i*k;
+				if(iter == 0) {
+					for(int d = 0; d < dims; d++)
+						p[d] = x[d*n + i];
+					all_distances(p, ct, k, dims, l);
+					ev += k;
+					a = 0;
+					for(int j = 1; j < k; j++)
+						if(l[j] < l[a])
+							a = j;
+					up[i] = l[a];
+					lmin[i] = min_other(l, k, a);
+					relabel(x, n, dims, i, label[i], a, lsum, lcount);
+					changed += a != label[i];
+					label[i] = a;
+					continue;
+				}
+				float u = up[i] += delta[a];
+				lmin[i] -= a == jmax ? dsecond : dmax;
+				if(u <= s[a] || u <= lmin[i])
+					continue;
+				for(int d = 0; d < dims; d++)
+					p[d] = x[d*n + i];
+				u = up[i] = distance(p, c + a*dims, dims);
+				ev++;
+				if(u <= s[a] || u <= lmin[i])
+					continue;
+				/* Bring the bounds up to date, raise them to the gap to the
+				   assigned centroid less u, and count the centroids they do
+				   not rule out; u only shrinks below, so none of the others
+				   can come back */
+				const double *now = drift + (long)iter*k, *then = drift + (long)seen[i]*k;
+				const float *ca = cc + a*k;
+				int open = 0;
+				float near = INFINITY;
+				#pragma omp simd reduction(+:open) reduction(min:near)
+				for(int j = 0; j < k; j++) {
+					float lj = l[j] - (float)(now[j] - then[j]);
+					lj = ca[j] - u > lj ? ca[j] - u : lj;
+					l[j] = lj > 0 ? lj : 0;
+					open += j != a && u > l[j];
+					near = j != a && l[j] < near ? l[j] : near;
+				}
+				seen[i] = iter;
+				l[a] = u;
+				if(open == 0) {
+					lmin[i] = near;
+					continue;
+				}
+				for(int j = 0; j < k; j++) {
+					if(j == a || u <= l[j] || u <= cc[a*k + j] / 2)
+						continue;
+					l[j] = distance(p, c + j*dims, dims);
+					ev++;
+					if(l[j] < u) {
+						a = j;
+						u = l[j];
+					}
+				}
+				up[i] = u;
+				lmin[i] = min_other(l, k, a);
+				if(a != label[i]) {
+					relabel(x, n, dims, i, label[i], a, lsum, lcount);
+					changed++;
+					label[i] = a;
+				}
+			}
+			merge_changes(lsum, lcount, sum, count, k, dims);
+		}
+		iter++;
+		float move = move_centroids(sum, count, k, dims, c, delta);
+		if(move < TOL * TOL || changed == 0)
+			break;
+		for(int j = 0; j < k; j++)
+			drift[(long)iter*k + j] = drift[(long)(iter - 1)*k + j] + delta[j];
+		largest_moves(delta, k, &jmax, &dmax, &dsecond);
+		centroid_gaps(c, k, dims, cc, s, ct);
+	}
+	*evals = ev;
+	free(sum);	free(up);	free(lo);	free(cc);	free(s);	free(ct);	free(delta);
+	free(lmin);	free(drift);	free(seen);
+	return iter;
+}
+
+/* Sum of squared distances from each point to its centroid */
+double sum_sq_error(const float *x, long n, int dims, const float *c, const int *label) {
+	double err = 0;
+	long i;
+	#pragma omp parallel for reduction(+:err)
+	for(i = 0; i < n; i++)
+		for(int d = 0; d < dims; d++) {
+			float t = x[d*n + i] - c[label[i]*dims + d];
+			err += t * t;
+		}
+	return err;
+}
+
+int main(int argc, char *argv[]) {
+	int k = argc > 1 ? atoi(argv[1]) : 4;
+	int dims = argc > 2 ? atoi(argv[2]) : 2;
+	int max_iter = argc > 3 ? atoi(argv[3]) : 50;
+	const char *method = argc > 4 ? argv[4] : "lloyd";
+	int (*kmeans)(const float*, long, int, int, float*, int*, int, int, long*, long*) =
+		strcmp(method, "lloyd") == 0 ? kmeans_lloyd
+		: strcmp(method, "hamerly") == 0 ? kmeans_hamerly
+		: strcmp(method, "elkan") == 0 ? kmeans_elkan : NULL;
+	if(k < 1 || dims < 1 || max_iter < 1 || kmeans == NULL) {
+		printf("Usage: %s [clusters] [dimensions] [max-iterations] [lloyd|hamerly|elkan]\n", argv[0]);
+		return 1;
+	}
+	char *o = output;
+	double t, sse;
+	long evals = 0;
+	o += sprintf(o, "Time per iteration, %d clusters, %d dimensions, %s\nSize\t\tT1\t\tT2\t\tT4\t\tT8\t\tIterations\tDistances skipped\n", k, dims, method);
+	for(int index=0; index<5; index++){
+		long n = points_sizes[index];
+		float *x = malloc(sizeof(float) * n * dims);
+		float *c = malloc(sizeof(float) * k * dims);
+		int *label = malloc(sizeof(int) * n);
+		long *count = malloc(sizeof(long) * k);
+		int iter = 0;
+		printf("Size: %ld",n);
+		o += sprintf(o, "%8ld\t",n);
+		if(kmeans == kmeans_elkan && sizeof(float) * n * k > ELKAN_MAX_BYTES) {
+			printf("\nSkipped: Elkan bounds need %ld MB\n", sizeof(float) * n * k >> 20);
+			o += sprintf(o, "-\n");
+			free(x);	free(c);	free(label);	free(count);
+			continue;
+		}
+		populate_points(x, n, k, dims);
+		for(int nt=1;nt<9;nt*=2){
+			init_centroids(x, n, k, dims, c);
+			memset(label, -1, sizeof(int) * n);
+			t = omp_get_wtime();
+			iter = kmeans(x, n, dims, k, c, label, max_iter, nt, count, &evals);
 			t = omp_get_wtime() - t;
-			sprintf(output,"%s%.4lfs\t",output,t);
-			if (nt==8)
-			for(i = 0; i < CLUSTER_SIZE; i++)
-				printf("\nCluster (%d, %d): %lld", cluster[i][0], cluster[i][1], cluster_count[i]);
+			o += sprintf(o, "%.4lfms\t",t / iter * 1000);
 		}
+		sse = sum_sq_error(x, n, dims, c, label);
+		o += sprintf(o, "%d\t\t%.1f%%\n", iter, 100 * (1 - (double)evals / ((double)n * k * iter)));
+		printf("\nSum of squared distances: %.6g", sse);
+		if(k <= 8)
+			for(int j = 0; j < k; j++) {
+				printf("\nCluster (");
+				for(int d = 0; d < dims; d++)
+					printf(d ? ", %.2f" : "%.2f", c[j*dims + d]);
+				printf("): %ld", count[j]);
+			}
 		printf("\n");
-		sprintf(output,"%s\n",output);
+		free(x);	free(c);	free(label);	free(count);
 	}
 	puts(output);
 	return 0;
@@ -0,0 +1,232 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<string.h>
+#include<mpi.h>
+#include<omp.h>
+#include<math.h>
+#define SEED 3655942
+#define BLOCK 256
+#define TOL 1e-3f
+
+/* Counter-based generator, as in program5: point i is the same whichever
+   rank or thread produces it */
+static inline uint64_t mix64(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline float uniform(uint64_t key) {
+	return (mix64(key) >> 40) * (1.0f / 16777216.0f);
+}
+
+/* Global points [first, first+n) into the SoA shard x[d*n + i] */
+void populate_points(float *x, long first, long n, int k, int dims) {
+	long i;
+	#pragma omp parallel for schedule(static)
+	for(i = 0; i < n; i++) {
+		uint64_t g = first + i, blob = mix64(SEED + g) % k;
+		for(int d = 0; d < dims; d++) {
+			float centre = 100 * uniform(SEED ^ ((blob * dims + d + 1) << 40));
+			uint64_t key = (1ULL << 62) + ((g * dims + d) << 1);
+			x[d*n + i] = centre + 8 * (uniform(key) + uniform(key + 1) - 1);
+		}
+	}
+}
+
+/* One assignment pass over n points of the shard, x[d*ld + i]. Adds
+   centroid sums and counts to acc[0 .. k*dims) and acc[k*dims .. k*dims+k),
+   and returns the number of changed labels and the squared error in
+   stat[0], stat[1]. */
+void assign(const float *x, long ld, long n, int dims, int k, const float *c, int *label,
+		double *acc, double *stat) {
+	long changed = 0;
+	double err = 0;
+	#pragma omp parallel reduction(+:changed,err)
+	{
+		double *lacc = calloc(k * dims + k, sizeof(double));
+		float best[BLOCK], dist[BLOCK];
+		int bestj[BLOCK];
+		long b;
+		#pragma omp for schedule(static)
+		for(b = 0; b < n; b += BLOCK) {
+			int m = n - b < BLOCK ? n - b : BLOCK;
+			for(int i = 0; i < m; i++) {
+				best[i] = INFINITY;
+				bestj[i] = 0;
+			}
+			for(int j = 0; j < k; j++) {
+				memset(dist, 0, sizeof(dist));
+				for(int d = 0; d < dims; d++) {
+					const float *xd = x + d*ld + b;
+					float cd = c[j*dims + d];
+					#pragma omp simd
+					for(int i = 0; i < m; i++)
+						dist[i] += (xd[i] - cd) * (xd[i] - cd);
+				}
+				#pragma omp simd
+				for(int i = 0; i < m; i++)
+					if(dist[i] < best[i]) {
+						best[i] = dist[i];
+						bestj[i] = j;
+					}
+			}
+			for(int i = 0; i < m; i++) {
+				int j = bestj[i];
+				changed += label[b + i] != j;
+				label[b + i] = j;
+				lacc[k*dims + j]++;
+				err += best[i];
+				for(int d = 0; d < dims; d++)
+					lacc[j*dims + d] += x[d*ld + b + i];
+			}
+		}
+		#pragma omp critical
+		for(int j = 0; j < k * dims + k; j++)
+			acc[j] += lacc[j];
+		free(lacc);
+	}
+	stat[0] = changed;
+	stat[1] = err;
+}
+
+/* New centroids from the global sums; returns the largest squared move */
+float update_centroids(const double *acc, int k, int dims, float *c) {
+	float move = 0;
+	for(int j = 0; j < k; j++)
+		if(acc[k*dims + j] > 0) {
+			float m = 0;
+			for(int d = 0; d < dims; d++) {
+				float v = acc[j*dims + d] / acc[k*dims + j];
+				m += (v - c[j*dims + d]) * (v - c[j*dims + d]);
+				c[j*dims + d] = v;
+			}
+			move = m > move ? m : move;
+		}
+	return move;
+}
+
+int main(int argc, char *argv[]) {
+	int rank, nprocs, provided, overlap = 0;
+	MPI_Init_thread(&argc,&argv,MPI_THREAD_FUNNELED,&provided);
+	MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+	MPI_Comm_size(MPI_COMM_WORLD,&nprocs);
+	if(argc > 1 && strcmp(argv[argc - 1], "-o") == 0) {
+		overlap = 1;
+		argc--;
+	}
+	long n = argc > 1 ? (long)strtod(argv[1], NULL) : 0;
+	int k = argc > 2 ? atoi(argv[2]) : 4;
+	int dims = argc > 3 ? atoi(argv[3]) : 2;
+	int max_iter = argc > 4 ? atoi(argv[4]) : 50;
+	if(n < 1 || k < 1 || dims < 1 || max_iter < 1 || n / k < 1) {
+		if(rank==0)
+			printf("Usage: %s points [clusters] [dimensions] [max-iterations] [-o]\n", argv[0]);
+		MPI_Finalize();
+		return 1;
+	}
+
+	/* Each rank generates and keeps only its own shard */
+	long first = n / nprocs * rank + (rank < n % nprocs ? rank : n % nprocs);
+	long local = n / nprocs + (rank < n % nprocs);
+	float *x = malloc(sizeof(float) * (local * dims + 1));
+	int *label = malloc(sizeof(int) * (local + 1));
+	float *c = calloc(k * dims, sizeof(float));
+	double *acc = malloc(sizeof(double) * (k * dims + k + 2));
+	populate_points(x, first, local, k, dims);
+	memset(label, -1, sizeof(int) * local);
+	/* Same start as program5: centroid j is global point j*(n/k), taken
+	   from whichever rank holds it */
+	for(int j = 0; j < k; j++) {
+		long g = j * (n / k);
+		if(g >= first && g < first + local)
+			for(int d = 0; d < dims; d++)
+				c[j*dims + d] = x[d*local + g - first];
+	}
+	MPI_Allreduce(MPI_IN_PLACE, c, k * dims, MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD);
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	double t = MPI_Wtime(), stat[2], sse = 0;
+	int iter = 0, done = 0, len = k * dims + k + 2;
+	if(!overlap) {
+		while(!done && iter < max_iter) {
+			memset(acc, 0, sizeof(double) * len);
+			assign(x, local, local, dims, k, c, label, acc, stat);
+			iter++;
+			/* Sums, counts, changed labels and error in one reduction */
+			acc[k*dims + k] = stat[0];
+			acc[k*dims + k + 1] = stat[1];
+			MPI_Allreduce(MPI_IN_PLACE, acc, len, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+			float move = update_centroids(acc, k, dims, c);
+			sse = acc[k*dims + k + 1];
+			done = acc[k*dims + k] == 0 || move < TOL * TOL;
+		}
+	}
+	else {
+		/* The shard is split in two halves that take turns. While one
+		   half's sums reduce in the background the other half is assigned,
+		   and after each wait the centroids are rebuilt from the latest
+		   global sums of both halves. Every reduction is hidden behind an
+		   assignment, at the cost of twice the messages per iteration and
+		   centroids up to one half-pass behind; once converged both halves
+		   see the same centroids, so it stops at a fixed point of Lloyd. */
+		long off[2] = {0, local / 2}, part[2] = {local / 2, local - local / 2};
+		double *part_acc[2], *sum[2];
+		for(int h = 0; h < 2; h++) {
+			part_acc[h] = malloc(sizeof(double) * len);
+			sum[h] = calloc(len, sizeof(double));
+		}
+		MPI_Request req = MPI_REQUEST_NULL;
+		float last_move = INFINITY;
+		long pass;
+		for(pass = 0; !done && pass < 2L * max_iter; pass++) {
+			int h = pass % 2;
+			memset(part_acc[h], 0, sizeof(double) * len);
+			assign(x + off[h], local, part[h], dims, k, c, label + off[h], part_acc[h], stat);
+			part_acc[h][k*dims + k] = stat[0];
+			part_acc[h][k*dims + k + 1] = stat[1];
+			MPI_Wait(&req, MPI_STATUS_IGNORE);
+			/* From the third half-pass on both halves have global sums.
+			   Only one half's sums are new at each update, so the move
+			   test spans the last two updates, a whole iteration. */
+			if(pass >= 2) {
+				for(int j = 0; j < len; j++)
+					acc[j] = sum[0][j] + sum[1][j];
+				float move = update_centroids(acc, k, dims, c);
+				done = acc[k*dims + k] == 0 || (move < TOL * TOL && last_move < TOL * TOL);
+				last_move = move;
+			}
+			MPI_Iallreduce(part_acc[h], sum[h], len, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD, &req);
+		}
+		MPI_Wait(&req, MPI_STATUS_IGNORE);
+		for(int j = 0; j < len; j++)
+			acc[j] = sum[0][j] + sum[1][j];
+		update_centroids(acc, k, dims, c);
+		sse = acc[k*dims + k + 1];
+		iter = (pass + 1) / 2;
+		for(int h = 0; h < 2; h++) {
+			free(part_acc[h]);
+			free(sum[h]);
+		}
+	}
+	t = MPI_Wtime() - t;
+
+	if(rank==0) {
+		printf("%ld points, %d clusters, %d dimensions, %d ranks x %d threads%s\n", n, k, dims,
+			nprocs, omp_get_max_threads(), overlap ? ", overlapped half-shard reductions" : "");
+		printf("%d iterations, %.4lfms per iteration\n", iter, t / iter * 1000);
+		printf("Sum of squared distances: %.6g", sse);
+		if(k <= 8)
+			for(int j = 0; j < k; j++) {
+				printf("\nCluster (");
+				for(int d = 0; d < dims; d++)
+					printf(d ? ", %.2f" : "%.2f", c[j*dims + d]);
+				printf("): %.0f", acc[k*dims + j]);
+			}
+		printf("\n");
+	}
+	free(x);	free(label);	free(c);	free(acc);
+	MPI_Finalize();
+	return 0;
+}
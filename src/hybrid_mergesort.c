@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <math.h>
 #include <mpi.h>
 #include <omp.h>
@@ -47,19 +48,112 @@ double get_time(void)
 
 #define SMALL    32
 
+// Cache-aware multiway mode: sort blocks of CACHE_BLOCK keys (block plus
+// temp take half of a 2 MiB L2), then merge up to MERGE_WAYS runs per pass
+#define CACHE_BLOCK    (1 << 17)
+#define MERGE_WAYS     16
+
+// Sorted-run codec block size (keys) and number of interleaved lanes
+#define RUN_BLOCK    128
+#define RUN_LANES    4
+
+// Set by -z: helpers send their sorted runs block bit-packed
+int compress_runs = 0;
+
+// Verification state of this process: the number of runs found out of
+// order or not matching what their sender sent, and the time spent checking
+long long run_bad = 0;
+double verify_time = 0.0;
+
+// Local sort used at the leaves of mergesort_parallel_omp
+#define ALG_MERGESORT    0
+#define ALG_QSORT        1
+#define ALG_MULTIWAY     2
+
+// Calibration: default profile file and sort size for the measurements
+#define PROFILE_FILE     "hybrid_mergesort.profile"
+#define CALIB_SIZE       (1 << 21)
+
+// Leaf cutoff and local algorithm; "auto" takes them from the profile
+int small_cutoff = SMALL;
+int local_algorithm = ALG_MERGESORT;
+
+// One group of the group-by mode: a key with its record count and value sum
+struct group
+{
+  long long count;
+  long long sum;
+  int key;
+};
+
+// MPI datatype for struct group, created by run_groupby_hybrid
+MPI_Datatype group_type;
+
+// Machine profile written by "calibrate" and read by "auto"
+struct profile
+{
+  int cutoff;			// fastest insertion-sort cutoff
+  int algorithm;		// fastest local sort, ALG_*
+  double sort_ns;		// ns per key per log2(n) level of that sort
+  double merge_ns;		// ns per key of a two-way merge
+  double p2p_latency_us;	// point-to-point latency, 0 if not measured
+  double p2p_bandwidth_mbs;	// point-to-point bandwidth, 0 if not measured
+};
+
 extern double get_time (void);
 void merge (int a[], int size, int temp[]);
 void insertion_sort (int a[], int size);
 void mergesort_serial (int a[], int size, int temp[]);
-void mergesort_parallel_mpi (int a[], int size, int temp[],
-			     int level, int my_rank, int max_rank,
-			     int tag, MPI_Comm comm, int threads);
+void mergesort_multiway (int a[], int size, int temp[]);
+void sort_block (int a[], int size, int temp[]);
+void merge_runs (int src[], int pos[], int end[], int ways, int out[]);
+unsigned long long mergesort_parallel_mpi (int a[], int size, int temp[],
+					   int level, int my_rank,
+					   int max_rank, int tag,
+					   MPI_Comm comm, int threads);
 int topmost_level_mpi (int my_rank);
-void run_root_mpi (int a[], int size, int temp[], int max_rank, int tag,
-		   MPI_Comm comm, int threads);
+int run_encoded_words (int size);
+int encode_run (int a[], int size, unsigned int out[]);
+void decode_run (unsigned int in[], int size, int a[]);
+void send_run (int a[], int size, int dest, int tag, MPI_Comm comm);
+void recv_run (int a[], int size, int source, int tag, MPI_Comm comm);
+unsigned long long run_root_mpi (int a[], int size, int temp[],
+				 int max_rank, int tag, MPI_Comm comm,
+				 int threads);
 void run_node_mpi (int my_rank, int max_rank, int tag, MPI_Comm comm,
 		   int threads);
 void mergesort_parallel_omp (int a[], int size, int temp[], int threads);
+void local_sort (int a[], int size, int temp[]);
+int compare_int (const void *x, const void *y);
+const char *algorithm_name (int algorithm);
+void calibrate_mpi (const char *path, MPI_Comm comm);
+int read_profile (const char *path, struct profile *pr);
+double predict_time (const struct profile *pr, double size, int procs,
+		     int threads);
+void auto_tune_mpi (const char *path, int size, int *procs, int *threads,
+		    MPI_Comm comm);
+unsigned long long key_hash (int key);
+long long verify_range_omp (int a[], int size, unsigned long long *hash,
+			    int threads);
+unsigned long long check_run_omp (int a[], int size, int threads);
+unsigned long long merge_checked (int a[], int size, int temp[],
+				  unsigned long long expected);
+void send_run_stats (int a[], int size, unsigned long long hash, int dest,
+		     int tag, MPI_Comm comm);
+unsigned long long recv_run_stats (int a[], int size, int source, int tag,
+				   MPI_Comm comm, int threads);
+void verify_sorted_hybrid (unsigned long long output_hash,
+			   unsigned long long input_hash, MPI_Comm comm);
+void run_groupby_hybrid (int size, int key_range, int max_rank, int tag,
+			 MPI_Comm comm, int threads);
+int groupby_parallel_mpi (struct group g[], int size, struct group temp[],
+			  int level, int my_rank, int max_rank, int tag,
+			  MPI_Comm comm, int threads);
+int groupby_parallel_omp (struct group g[], int size, struct group temp[],
+			  int threads);
+int groupby_serial (struct group g[], int size, struct group temp[]);
+int merge_groups (struct group a[], int na, struct group b[], int nb,
+		  struct group out[]);
 int main (int argc, char *argv[]);
 
 int main (int argc, char *argv[])
@@ -75,18 +169,52 @@ int main (int argc, char *argv[])
   int max_rank = comm_size - 1;
   int tag = 123;
 
-  if (argc != 3)		
+  int manual_multiway = 0;
+  while (argc > 1 && (strcmp (argv[argc - 1], "-z") == 0
+		      || strcmp (argv[argc - 1], "-m") == 0))
+    {
+      if (strcmp (argv[argc - 1], "-z") == 0)
+	compress_runs = 1;
+      else
+	manual_multiway = 1;
+      argc--;
+    }
+  if (argc >= 2 && argc <= 3 && strcmp (argv[1], "calibrate") == 0)
+    {
+      calibrate_mpi (argc == 3 ? argv[2] : PROFILE_FILE, MPI_COMM_WORLD);
+      MPI_Finalize ();
+      return 0;
+    }
+  int tuned = argc >= 3 && strcmp (argv[2], "auto") == 0;
+  int grouped = !tuned && argc >= 4 && strcmp (argv[3], "groupby") == 0;
+  if (argc != 3 && !(tuned && argc == 4) && !(grouped && argc <= 5))
     {
       if (my_rank == 0)
 	{
-	  printf ("Usage: %s array-size OMP-threads-per-MPI-process>0\n",
-		  argv[0]);
+	  printf ("Usage: %s array-size OMP-threads-per-MPI-process>0 [-z] [-m]\n"
+		  "       %s array-size auto [profile] [-z]\n"
+		  "       %s array-size OMP-threads-per-MPI-process>0 groupby [key-range]\n"
+		  "       %s calibrate [profile]\n",
+		  argv[0], argv[0], argv[0], argv[0]);
 	}
       MPI_Abort (MPI_COMM_WORLD, 1);
     }
 
   int size = atoi (argv[1]);	
-  int threads = atoi (argv[2]);	
+  int threads;
+  if (tuned)
+    {
+      int procs;
+      auto_tune_mpi (argc == 4 ? argv[3] : PROFILE_FILE, size, &procs,
+		     &threads, MPI_COMM_WORLD);
+      max_rank = procs - 1;
+    }
+  else
+    {
+      threads = atoi (argv[2]);
+      if (manual_multiway)
+	local_algorithm = ALG_MULTIWAY;
+    }
   if (threads < 1)
     {
       if (my_rank == 0)
@@ -96,18 +224,28 @@ int main (int argc, char *argv[])
 	}
       MPI_Abort (MPI_COMM_WORLD, 1);
     }
+  if (grouped)
+    {
+      int key_range = argc == 5 ? atoi (argv[4]) : size;
+      run_groupby_hybrid (size, key_range > 0 ? key_range : 1, max_rank, tag,
+			  MPI_COMM_WORLD, threads);
+      MPI_Finalize ();
+      return 0;
+    }
   
+  int *a = NULL;
+  unsigned long long input_hash = 0, output_hash = 0;
   if (my_rank == 0)
     {				
       puts("-Multilevel parallel Recursive Mergesort with MPI and OpenMP-\t");
-      printf ("Array size = %d\nProcesses = %d\nThreads per process = %d\n",size, comm_size, threads);
+      printf ("Array size = %d\nProcesses = %d\nThreads per process = %d\n",size, max_rank + 1, threads);
       
       if (omp_get_nested () != 1)
 	    {
 	        puts ("Warning: Nested parallelism desired but unavailable");
 	    }
     
-      int *a = (int *)malloc (sizeof (int) * size);
+      a = (int *)malloc (sizeof (int) * size);
       int *temp = (int *)malloc (sizeof (int) * size);
       if (a == NULL || temp == NULL)
 	{
@@ -120,25 +258,28 @@ int main (int argc, char *argv[])
       for (i = 0; i < size; i++)
 	{
 	  a[i] = rand () % size;
+	  input_hash += key_hash (a[i]);
 	}
     
       double start = get_time ();
-      run_root_mpi (a, size, temp, max_rank, tag, MPI_COMM_WORLD, threads);
+      output_hash = run_root_mpi (a, size, temp, max_rank, tag, MPI_COMM_WORLD, threads);
       double end = get_time ();
       printf ("Start = %.2f\nEnd = %.2f\nElapsed = %.2f\n",start, end, end - start);
-      
+      free (temp);
    }				
-  else
+  else if (my_rank <= max_rank)
     {				  
       run_node_mpi (my_rank, max_rank, tag, MPI_COMM_WORLD, threads);
     }
+  verify_sorted_hybrid (output_hash, input_hash, MPI_COMM_WORLD);
+  free (a);
  
   MPI_Finalize ();
   return 0;
 }
 
 // Root process code
-void run_root_mpi (int a[], int size, int temp[], int max_rank, int tag,MPI_Comm comm, int threads)
+unsigned long long run_root_mpi (int a[], int size, int temp[], int max_rank, int tag,MPI_Comm comm, int threads)
 {
   int my_rank;
   MPI_Comm_rank (comm, &my_rank);
@@ -147,8 +288,7 @@ void run_root_mpi (int a[], int size, int temp[], int max_rank, int tag,MPI_Comm
       printf("Error: run_root_mpi called from process %d; must be called from process 0 only\n",my_rank);
       MPI_Abort (MPI_COMM_WORLD, 1);
     }
-  mergesort_parallel_mpi (a, size, temp, 0, my_rank, max_rank, tag, comm, threads);	
-  return;
+  return mergesort_parallel_mpi (a, size, temp, 0, my_rank, max_rank, tag, comm, threads);
 }
 
 // Node process code
@@ -162,12 +302,640 @@ void run_node_mpi (int my_rank, int max_rank, int tag, MPI_Comm comm, int thread
   int parent_rank = status.MPI_SOURCE;
   // Allocate int a[size], temp[size] 
   int *a = (int *) malloc (sizeof (int) * size);
+  int *temp = (int *) malloc (sizeof (int) * size);
   MPI_Recv (a, size, MPI_INT, parent_rank, tag, comm, &status);
-  // Send sorted array to parent process
-  MPI_Send (a, size, MPI_INT, parent_rank, tag, comm);
+  unsigned long long hash =
+    mergesort_parallel_mpi (a, size, temp, topmost_level_mpi (my_rank),
+			    my_rank, max_rank, tag, comm, threads);
+  // Send sorted array to parent process, then what it should find in it
+  send_run (a, size, parent_rank, tag, comm);
+  send_run_stats (a, size, hash, parent_rank, tag, comm);
+  free (temp);
+  free (a);
   return;
 }
 
+// Calibration run, called by every process.
+// Rank 0 times the local sorts for each leaf cutoff, the two-way merge and,
+// when a second process exists, a ping-pong with rank 1; it then writes the
+// profile that "auto" reads.
+void calibrate_mpi (const char *path, MPI_Comm comm)
+{
+  int my_rank, comm_size;
+  MPI_Comm_rank (comm, &my_rank);
+  MPI_Comm_size (comm, &comm_size);
+  int tag = 124;
+  int big = 1 << 20;
+  int *buf = (int *) malloc (sizeof (int) * big);
+  struct profile pr = { SMALL, ALG_MERGESORT, 0.0, 0.0, 0.0, 0.0 };
+  double start;
+  int i, rep;
+
+  if (my_rank == 0)
+    {
+      static const int cutoffs[] = { 8, 16, 32, 64, 128 };
+      int n = CALIB_SIZE;
+      int *a = (int *) malloc (sizeof (int) * n);
+      int *temp = (int *) malloc (sizeof (int) * n);
+      double levels = n * log2 (n) * 1.0e-9;
+      double best = 0.0;
+      unsigned int c;
+      puts ("-Calibrating hybrid mergesort-\t");
+      for (c = 0; c < sizeof (cutoffs) / sizeof (cutoffs[0]); c++)
+	{
+	  small_cutoff = cutoffs[c];
+	  srand (314158);
+	  for (i = 0; i < n; i++)
+	    a[i] = rand () % n;
+	  start = get_time ();
+	  mergesort_serial (a, n, temp);
+	  double t = get_time () - start;
+	  printf ("mergesort cutoff %3d: %.3f s\n", small_cutoff, t);
+	  if (c == 0 || t < best)
+	    {
+	      best = t;
+	      pr.cutoff = small_cutoff;
+	    }
+	}
+      srand (314158);
+      for (i = 0; i < n; i++)
+	a[i] = rand () % n;
+      start = get_time ();
+      qsort (a, n, sizeof (int), compare_int);
+      double t = get_time () - start;
+      printf ("qsort:                %.3f s\n", t);
+      if (t < best)
+	{
+	  best = t;
+	  pr.algorithm = ALG_QSORT;
+	}
+      small_cutoff = pr.cutoff;
+      srand (314158);
+      for (i = 0; i < n; i++)
+	a[i] = rand () % n;
+      start = get_time ();
+      mergesort_multiway (a, n, temp);
+      t = get_time () - start;
+      printf ("multiway:             %.3f s\n", t);
+      if (t < best)
+	{
+	  best = t;
+	  pr.algorithm = ALG_MULTIWAY;
+	}
+      pr.sort_ns = best / levels;
+
+      // Merge of two sorted random halves, best of three
+      for (rep = 0; rep < 3; rep++)
+	{
+	  for (i = 0; i < n; i++)
+	    a[i] = rand () % n;
+	  mergesort_serial (a, n / 2, temp);
+	  mergesort_serial (a + n / 2, n - n / 2, temp);
+	  start = get_time ();
+	  merge (a, n, temp);
+	  t = (get_time () - start) * 1.0e9 / n;
+	  if (rep == 0 || t < pr.merge_ns)
+	    pr.merge_ns = t;
+	}
+      free (temp);
+      free (a);
+    }
+
+  // Ping-pong between ranks 0 and 1: one-int messages for latency, then
+  // 4 MiB messages for bandwidth
+  if (comm_size > 1 && my_rank <= 1)
+    {
+      int other = 1 - my_rank;
+      int lat_reps = 100, bw_reps = 10;
+      MPI_Status status;
+      for (i = 0; i < big; i++)
+	buf[i] = i;
+      start = get_time ();
+      for (rep = 0; rep < lat_reps; rep++)
+	{
+	  if (my_rank == 0)
+	    {
+	      MPI_Send (buf, 1, MPI_INT, other, tag, comm);
+	      MPI_Recv (buf, 1, MPI_INT, other, tag, comm, &status);
+	    }
+	  else
+	    {
+	      MPI_Recv (buf, 1, MPI_INT, other, tag, comm, &status);
+	      MPI_Send (buf, 1, MPI_INT, other, tag, comm);
+	    }
+	}
+      double lat = (get_time () - start) / (2.0 * lat_reps);
+      start = get_time ();
+      for (rep = 0; rep < bw_reps; rep++)
+	{
+	  if (my_rank == 0)
+	    {
+	      MPI_Send (buf, big, MPI_INT, other, tag, comm);
+	      MPI_Recv (buf, big, MPI_INT, other, tag, comm, &status);
+	    }
+	  else
+	    {
+	      MPI_Recv (buf, big, MPI_INT, other, tag, comm, &status);
+	      MPI_Send (buf, big, MPI_INT, other, tag, comm);
+	    }
+	}
+      double per_msg = (get_time () - start) / (2.0 * bw_reps) - lat;
+      pr.p2p_latency_us = lat * 1.0e6;
+      pr.p2p_bandwidth_mbs = sizeof (int) * (double) big / per_msg / 1.0e6;
+    }
+  free (buf);
+
+  if (my_rank == 0)
+    {
+      FILE *fp = fopen (path, "w");
+      if (fp == NULL)
+	{
+	  printf ("Error: Could not write profile %s\n", path);
+	  MPI_Abort (MPI_COMM_WORLD, 1);
+	}
+      fprintf (fp, "# hybrid_mergesort calibration profile\n");
+      fprintf (fp, "cutoff %d\n", pr.cutoff);
+      fprintf (fp, "algorithm %s\n", algorithm_name (pr.algorithm));
+      fprintf (fp, "sort_ns %g\n", pr.sort_ns);
+      fprintf (fp, "merge_ns %g\n", pr.merge_ns);
+      fprintf (fp, "p2p_latency_us %g\n", pr.p2p_latency_us);
+      fprintf (fp, "p2p_bandwidth_mbs %g\n", pr.p2p_bandwidth_mbs);
+      fclose (fp);
+      printf ("Profile written to %s\n", path);
+      if (comm_size == 1)
+	puts ("Warning: run with at least 2 processes to measure point-to-point bandwidth");
+    }
+}
+
+// Read a profile written by calibrate_mpi; returns 0 on success
+int read_profile (const char *path, struct profile *pr)
+{
+  FILE *fp = fopen (path, "r");
+  char line[256], key[64], value[64];
+  if (fp == NULL)
+    return -1;
+  memset (pr, 0, sizeof (*pr));
+  pr->cutoff = SMALL;
+  // One "key value" pair per line; comment lines are skipped whole,
+  // however many tokens they hold
+  while (fgets (line, sizeof (line), fp) != NULL)
+    {
+      if (line[strspn (line, " \t")] == '#'
+	  || sscanf (line, "%63s %63s", key, value) != 2)
+	continue;
+      if (strcmp (key, "cutoff") == 0)
+	pr->cutoff = atoi (value);
+      else if (strcmp (key, "algorithm") == 0)
+	pr->algorithm = strcmp (value, "qsort") == 0 ? ALG_QSORT
+	  : strcmp (value, "multiway") == 0 ? ALG_MULTIWAY : ALG_MERGESORT;
+      else if (strcmp (key, "sort_ns") == 0)
+	pr->sort_ns = atof (value);
+      else if (strcmp (key, "merge_ns") == 0)
+	pr->merge_ns = atof (value);
+      else if (strcmp (key, "p2p_latency_us") == 0)
+	pr->p2p_latency_us = atof (value);
+      else if (strcmp (key, "p2p_bandwidth_mbs") == 0)
+	pr->p2p_bandwidth_mbs = atof (value);
+    }
+  fclose (fp);
+  return pr->sort_ns > 0 && pr->merge_ns > 0 ? 0 : -1;
+}
+
+// Predicted sort time for size keys over procs processes of threads each.
+// The critical path is one leaf sort, the OpenMP merges above the leaves
+// (local, local / 2, ...), and per MPI level a transfer out and back plus
+// the merge of that level (size, size / 2, ...).
+double predict_time (const struct profile *pr, double size, int procs,
+		     int threads)
+{
+  double local = size / procs;
+  double leaf = local / threads;
+  double t = pr->sort_ns * 1.0e-9 * leaf * log2 (leaf > 2 ? leaf : 2);
+  t += pr->merge_ns * 1.0e-9 * 2.0 * local * (1.0 - 1.0 / threads);
+  if (procs > 1)
+    {
+      double levels = ceil (log2 (procs));
+      double shrink = 1.0 - pow (0.5, levels);
+      t += pr->merge_ns * 1.0e-9 * 2.0 * size * shrink;
+      t += 2.0 * levels * pr->p2p_latency_us * 1.0e-6;
+      t += 2.0 * size * shrink * sizeof (int) / (pr->p2p_bandwidth_mbs * 1.0e6);
+    }
+  return t;
+}
+
+// "auto": rank 0 reads the profile and picks the number of processes, the
+// threads per process, the leaf cutoff and the local sort for this size;
+// the choice is broadcast so every process applies it.
+void auto_tune_mpi (const char *path, int size, int *procs, int *threads,
+		    MPI_Comm comm)
+{
+  int my_rank, comm_size, local_ranks;
+  MPI_Comm_rank (comm, &my_rank);
+  MPI_Comm_size (comm, &comm_size);
+  MPI_Comm node;
+  MPI_Comm_split_type (comm, MPI_COMM_TYPE_SHARED, my_rank, MPI_INFO_NULL,
+		       &node);
+  MPI_Comm_size (node, &local_ranks);
+  MPI_Comm_free (&node);
+
+  int choice[4];
+  if (my_rank == 0)
+    {
+      struct profile pr;
+      if (read_profile (path, &pr) != 0)
+	{
+	  printf ("Error: Could not read profile %s; run \"calibrate\" first\n",
+		  path);
+	  MPI_Abort (MPI_COMM_WORLD, 1);
+	}
+      // Never put more busy processes on a node than it has cores
+      int cores = omp_get_num_procs ();
+      int max_procs = comm_size * cores / local_ranks;
+      if (max_procs < 1)
+	max_procs = 1;
+      if (max_procs > comm_size)
+	max_procs = comm_size;
+      if (pr.p2p_bandwidth_mbs <= 0 && comm_size > 1)
+	{
+	  puts ("Warning: profile has no point-to-point bandwidth; using all usable processes");
+	}
+      int p, t;
+      double best = -1.0;
+      choice[0] = max_procs;
+      choice[1] = 1;
+      for (p = 1; p <= max_procs; p++)
+	{
+	  if (pr.p2p_bandwidth_mbs <= 0 && p != max_procs)
+	    continue;
+	  int busy = (p * local_ranks + comm_size - 1) / comm_size;
+	  int max_threads = cores / busy > 1 ? cores / busy : 1;
+	  for (t = 1; t <= max_threads; t++)
+	    {
+	      double predicted = predict_time (&pr, size, p, t);
+	      if (best < 0 || predicted < best)
+		{
+		  best = predicted;
+		  choice[0] = p;
+		  choice[1] = t;
+		}
+	    }
+	}
+      choice[2] = pr.cutoff;
+      choice[3] = pr.algorithm;
+      printf ("Auto-tuned: processes used = %d, threads per process = %d, "
+	      "cutoff = %d, local sort = %s, predicted = %.2f\n",
+	      choice[0], choice[1], choice[2],
+	      algorithm_name (choice[3]), best);
+    }
+  MPI_Bcast (choice, 4, MPI_INT, 0, comm);
+  *procs = choice[0];
+  *threads = choice[1];
+  small_cutoff = choice[2];
+  local_algorithm = choice[3];
+}
+
+// Group-by mode, run by every process.
+// Rank 0 generates (key, value) records and computes count and sum per key
+// through the same process tree as the sort. Every sort step folds equal
+// keys as it merges, so a helper returns one group per distinct key in its
+// half. Groups that occur on both sides of a split (the straddling groups)
+// are folded when the parent merges the helper's run with its own. Return
+// traffic and the final output therefore scale with key cardinality, not N.
+void run_groupby_hybrid (int size, int key_range, int max_rank, int tag,
+			 MPI_Comm comm, int threads)
+{
+  int my_rank, comm_size;
+  MPI_Comm_rank (comm, &my_rank);
+  MPI_Comm_size (comm, &comm_size);
+  MPI_Type_contiguous (sizeof (struct group), MPI_BYTE, &group_type);
+  MPI_Type_commit (&group_type);
+
+  if (my_rank == 0)
+    {
+      puts ("-Multilevel parallel Group-by with MPI and OpenMP-\t");
+      printf ("Array size = %d\nKey range = %d\nProcesses = %d\n"
+	      "Threads per process = %d\n", size, key_range, comm_size,
+	      threads);
+      struct group *g = (struct group *) malloc (sizeof (struct group) * size);
+      struct group *temp =
+	(struct group *) malloc (sizeof (struct group) * size);
+      if (g == NULL || temp == NULL)
+	{
+	  printf ("Error: Could not allocate array of size %d\n", size);
+	  MPI_Abort (MPI_COMM_WORLD, 1);
+	}
+      long long input_sum = 0;
+      int i;
+      srand (314158);
+      for (i = 0; i < size; i++)
+	{
+	  g[i].key = rand () % key_range;
+	  g[i].count = 1;
+	  g[i].sum = rand () % 100;
+	  input_sum += g[i].sum;
+	}
+
+      double start = get_time ();
+      int groups = groupby_parallel_mpi (g, size, temp, 0, my_rank, max_rank,
+					 tag, comm, threads);
+      double end = get_time ();
+      printf ("Start = %.2f\nEnd = %.2f\nElapsed = %.2f\n", start, end,
+	      end - start);
+      printf ("Distinct keys = %d\n", groups);
+      for (i = 0; i < groups && i < 5; i++)
+	printf ("key %d: count %lld, sum %lld\n", g[i].key, g[i].count,
+		g[i].sum);
+
+      // Keys strictly increasing, and every record accounted for once
+      long long total_count = 0, total_sum = 0;
+      for (i = 0; i < groups; i++)
+	{
+	  if (i > 0 && !(g[i - 1].key < g[i].key))
+	    {
+	      printf ("Implementation error: group %d key %d after %d\n", i,
+		      g[i].key, g[i - 1].key);
+	      MPI_Abort (MPI_COMM_WORLD, 1);
+	    }
+	  total_count += g[i].count;
+	  total_sum += g[i].sum;
+	}
+      if (total_count != size || total_sum != input_sum)
+	{
+	  printf ("Implementation error: groups hold %lld records, sum %lld; "
+		  "expected %d, %lld\n", total_count, total_sum, size,
+		  input_sum);
+	  MPI_Abort (MPI_COMM_WORLD, 1);
+	}
+      puts ("-Success-");
+      free (temp);
+      free (g);
+    }
+  else if (my_rank <= max_rank)
+    {
+      MPI_Status status;
+      int size;
+      MPI_Probe (MPI_ANY_SOURCE, tag, comm, &status);
+      MPI_Get_count (&status, group_type, &size);
+      int parent_rank = status.MPI_SOURCE;
+      struct group *g = (struct group *) malloc (sizeof (struct group) * size);
+      struct group *temp =
+	(struct group *) malloc (sizeof (struct group) * size);
+      MPI_Recv (g, size, group_type, parent_rank, tag, comm, &status);
+      int groups = groupby_parallel_mpi (g, size, temp,
+					 topmost_level_mpi (my_rank), my_rank,
+					 max_rank, tag, comm, threads);
+      // Send folded groups to parent process
+      MPI_Send (g, groups, group_type, parent_rank, tag, comm);
+      free (temp);
+      free (g);
+    }
+  MPI_Type_free (&group_type);
+}
+
+// MPI group-by: same process tree as mergesort_parallel_mpi; returns the
+// number of groups left at the front of g
+int groupby_parallel_mpi (struct group g[], int size, struct group temp[],
+			  int level, int my_rank, int max_rank, int tag,
+			  MPI_Comm comm, int threads)
+{
+  int helper_rank = my_rank + pow (2, level);
+  if (helper_rank > max_rank)
+    {				// no more MPI processes available, then use OpenMP
+      return groupby_parallel_omp (g, size, temp, threads);
+    }
+  MPI_Request request;
+  MPI_Status status;
+  int half = size / 2, helper_groups;
+  // Send second half, asynchronous
+  MPI_Isend (g + half, size - half, group_type, helper_rank, tag, comm,
+	     &request);
+  int groups = groupby_parallel_mpi (g, half, temp, level + 1, my_rank,
+				     max_rank, tag, comm, threads);
+  // The helper's reply may be shorter than what was sent, so wait for the
+  // send before reusing its buffer
+  MPI_Wait (&request, &status);
+  MPI_Recv (g + half, size - half, group_type, helper_rank, tag, comm,
+	    &status);
+  MPI_Get_count (&status, group_type, &helper_groups);
+  groups = merge_groups (g, groups, g + half, helper_groups, temp);
+  memcpy (g, temp, groups * sizeof (struct group));
+  return groups;
+}
+
+// OpenMP group-by with given number of threads
+int groupby_parallel_omp (struct group g[], int size, struct group temp[],
+			  int threads)
+{
+  if (threads <= 1)
+    return groupby_serial (g, size, temp);
+  int half = size / 2, left, right;
+#pragma omp parallel sections
+  {
+#pragma omp section
+    left = groupby_parallel_omp (g, half, temp, threads / 2);
+#pragma omp section
+    right = groupby_parallel_omp (g + half, size - half, temp + half,
+				  threads - threads / 2);
+  }
+  int groups = merge_groups (g, left, g + half, right, temp);
+  memcpy (g, temp, groups * sizeof (struct group));
+  return groups;
+}
+
+// Sort g by key, folding equal keys; returns the number of groups
+int groupby_serial (struct group g[], int size, struct group temp[])
+{
+  int i, j, groups = 0;
+  if (size <= small_cutoff)
+    {
+      for (i = 0; i < size; i++)
+	{
+	  struct group v = g[i];
+	  for (j = i - 1; j >= 0 && g[j].key > v.key; j--)
+	    g[j + 1] = g[j];
+	  g[j + 1] = v;
+	}
+      for (i = 0; i < size; i++)
+	{
+	  if (groups > 0 && g[groups - 1].key == g[i].key)
+	    {
+	      g[groups - 1].count += g[i].count;
+	      g[groups - 1].sum += g[i].sum;
+	    }
+	  else
+	    {
+	      g[groups++] = g[i];
+	    }
+	}
+      return groups;
+    }
+  int half = size / 2;
+  int left = groupby_serial (g, half, temp);
+  int right = groupby_serial (g + half, size - half, temp);
+  groups = merge_groups (g, left, g + half, right, temp);
+  memcpy (g, temp, groups * sizeof (struct group));
+  return groups;
+}
+
+// Merge two runs of groups sorted by unique key into out, folding a key
+// present in both; returns the number of groups written
+int merge_groups (struct group a[], int na, struct group b[], int nb,
+		  struct group out[])
+{
+  int i1 = 0, i2 = 0, n = 0;
+  while (i1 < na && i2 < nb)
+    {
+      if (a[i1].key < b[i2].key)
+	{
+	  out[n++] = a[i1++];
+	}
+      else if (b[i2].key < a[i1].key)
+	{
+	  out[n++] = b[i2++];
+	}
+      else
+	{
+	  out[n] = a[i1++];
+	  out[n].count += b[i2].count;
+	  out[n++].sum += b[i2++].sum;
+	}
+    }
+  while (i1 < na)
+    out[n++] = a[i1++];
+  while (i2 < nb)
+    out[n++] = b[i2++];
+  return n;
+}
+
+// Order-independent multiset fingerprint: the sum of a 64-bit mix of each
+// key, so a lost, duplicated or altered key changes the total
+unsigned long long key_hash (int key)
+{
+  unsigned long long z = (unsigned int) key + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Hash a[0..size) and return the first index i with a[i - 1] > a[i], or
+// size if the range is sorted. Threads split the range; the check at each
+// index looks one key back, so thread boundaries are covered.
+long long verify_range_omp (int a[], int size, unsigned long long *hash,
+			    int threads)
+{
+  unsigned long long h = 0;
+  long long first_bad = size;
+  int i;
+#pragma omp parallel for num_threads(threads) reduction(+:h) reduction(min:first_bad)
+  for (i = 0; i < size; i++)
+    {
+      h += key_hash (a[i]);
+      if (i > 0 && a[i - 1] > a[i] && i < first_bad)
+	first_bad = i;
+    }
+  *hash = h;
+  return first_bad;
+}
+
+// Check a run where it is, with the process's threads: return the sum
+// of its key hashes and count it in run_bad if any neighbours are out of
+// order
+unsigned long long check_run_omp (int a[], int size, int threads)
+{
+  double start = get_time ();
+  unsigned long long hash;
+  run_bad += verify_range_omp (a, size, &hash, threads) < size;
+  verify_time += get_time () - start;
+  return hash;
+}
+
+// Merge the two sorted halves of a process-tree node, hashing every key
+// as it is emitted and checking it against the one before. expected is
+// the sum of the halves' hashes, each taken from the data itself, so a
+// key lost, duplicated or altered by the merge shows up as a mismatch.
+// Returns the hash of the merged run.
+unsigned long long merge_checked (int a[], int size, int temp[],
+				  unsigned long long expected)
+{
+  unsigned long long hash = 0;
+  int i1 = 0, i2 = size / 2, tempi = 0, bad = 0;
+  while (i1 < size / 2 || i2 < size)
+    {
+      if (i2 == size || (i1 < size / 2 && a[i1] < a[i2]))
+	temp[tempi] = a[i1++];
+      else
+	temp[tempi] = a[i2++];
+      hash += key_hash (temp[tempi]);
+      bad |= tempi > 0 && temp[tempi - 1] > temp[tempi];
+      tempi++;
+    }
+  memcpy (a, temp, size * sizeof (int));
+  run_bad += bad || hash != expected;
+  return hash;
+}
+
+// A helper's run is followed by what its parent should find in it: the
+// hash of the keys, the first and last key, and the helper's error count
+void send_run_stats (int a[], int size, unsigned long long hash, int dest,
+		     int tag, MPI_Comm comm)
+{
+  unsigned long long stats[4] = { hash, (unsigned long long) run_bad, 0, 0 };
+  if (size > 0)
+    {
+      stats[2] = (unsigned int) a[0];
+      stats[3] = (unsigned int) a[size - 1];
+    }
+  MPI_Send (stats, 4, MPI_UNSIGNED_LONG_LONG, dest, tag, comm);
+}
+
+// Check a run on the receiving side, after any decoding: its order, its
+// hash and its boundary keys must match what the helper sent. Returns the
+// hash of the keys actually received.
+unsigned long long recv_run_stats (int a[], int size, int source, int tag,
+				   MPI_Comm comm, int threads)
+{
+  unsigned long long stats[4];
+  MPI_Recv (stats, 4, MPI_UNSIGNED_LONG_LONG, source, tag, comm,
+	    MPI_STATUS_IGNORE);
+  unsigned long long hash = check_run_omp (a, size, threads);
+  run_bad += (long long) stats[1];
+  if (hash != stats[0]
+      || (size > 0 && (a[0] != (int) stats[2] || a[size - 1] != (int) stats[3])))
+    run_bad++;
+  return hash;
+}
+
+// Result of the verification, called by every process. Leaf runs were
+// checked where they were sorted, every run again where it was received
+// and every merge as it was made; rank 0 holds the errors gathered up the
+// process tree and the hash of the final array, which must equal the hash
+// it took of the input. The time is that of the slowest process's checks.
+void verify_sorted_hybrid (unsigned long long output_hash,
+			   unsigned long long input_hash, MPI_Comm comm)
+{
+  int my_rank;
+  double slowest;
+  MPI_Comm_rank (comm, &my_rank);
+  MPI_Reduce (&verify_time, &slowest, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+  if (my_rank != 0)
+    return;
+  printf ("Verify = %.2f\n", slowest);
+  if (run_bad > 0)
+    {
+      printf ("Implementation error: %lld failed checks of sorted, received "
+	      "and merged runs\n", run_bad);
+      MPI_Abort (MPI_COMM_WORLD, 1);
+    }
+  if (output_hash != input_hash)
+    {
+      printf ("Implementation error: output is not a permutation of the "
+	      "input (hash %016llx, expected %016llx)\n",
+	      output_hash, input_hash);
+      MPI_Abort (MPI_COMM_WORLD, 1);
+    }
+  puts ("-Success-");
+}
+
 // Given a process rank, calculate the top level of the process tree in which the process participates
 // Root assumed to always have rank 0 and to participate at level 0 of the process tree
 int topmost_level_mpi (int my_rank)
@@ -178,32 +946,149 @@ int topmost_level_mpi (int my_rank)
   return level;
 }
 
-// MPI merge sort
-void mergesort_parallel_mpi (int a[], int size, int temp[],int level, int my_rank, int max_rank,int tag, MPI_Comm comm, int threads)
+// MPI merge sort; returns the hash of the sorted keys, taken from the data
+unsigned long long mergesort_parallel_mpi (int a[], int size, int temp[],int level, int my_rank, int max_rank,int tag, MPI_Comm comm, int threads)
 {
   int helper_rank = my_rank + pow (2, level);
   if (helper_rank > max_rank)
     {				// no more MPI processes available, then use OpenMP
       mergesort_parallel_omp (a, size, temp, threads);
-     
+      return check_run_omp (a, size, threads);
     }
   else
     {
       MPI_Request request;
-      MPI_Status status;
       // Send second half, asynchronous
       MPI_Isend (a + size / 2, size - size / 2, MPI_INT, helper_rank, tag,comm, &request);
       
     
-      mergesort_parallel_mpi (a, size / 2, temp, level + 1, my_rank, max_rank,tag, comm, threads);
+      unsigned long long hash = mergesort_parallel_mpi (a, size / 2, temp, level + 1, my_rank, max_rank,tag, comm, threads);
       // Free the async request (matching receive will complete the transfer).
       MPI_Request_free (&request);
-      // Receive second half sorted
-      MPI_Recv (a + size / 2, size - size / 2, MPI_INT, helper_rank, tag,comm, &status);
+      // Receive second half sorted, and check it here
+      recv_run (a + size / 2, size - size / 2, helper_rank, tag, comm);
+      hash += recv_run_stats (a + size / 2, size - size / 2, helper_rank, tag,
+			      comm, threads);
       // Merge the two sorted sub-arrays through temp
-      merge (a, size, temp);
+      return merge_checked (a, size, temp, hash);
     }
-  return;
+}
+
+// Sorted-run codec for the helper -> parent transfers.
+// Runs are cut into blocks of RUN_BLOCK keys; a block is stored as its
+// first key, a bit width b, and the neighbour deltas packed at b bits.
+// Delta i goes to lane i % RUN_LANES and lanes are interleaved word by word,
+// so packing and unpacking run the lanes in lockstep (SIMD-BP128 layout).
+// Deltas are taken modulo 2^32, so unsorted input still round-trips.
+int run_encoded_words (int size)
+{
+  int blocks = (size + RUN_BLOCK - 1) / RUN_BLOCK;
+  return blocks * (2 + RUN_BLOCK);
+}
+
+int encode_run (int a[], int size, unsigned int out[])
+{
+  unsigned int delta[RUN_BLOCK];
+  int words = 0;
+  int start;
+  for (start = 0; start < size; start += RUN_BLOCK)
+    {
+      int n = size - start < RUN_BLOCK ? size - start : RUN_BLOCK;
+      unsigned int prev = (unsigned int) a[start], any = 0;
+      int i, j, l;
+      for (i = 0; i < RUN_BLOCK; i++)
+	{
+	  unsigned int v = i < n ? (unsigned int) a[start + i] : prev;
+	  delta[i] = v - prev;
+	  any |= delta[i];
+	  prev = v;
+	}
+      int b = 0;
+      while (b < 32 && (any >> b) != 0)
+	b++;
+      out[words++] = (unsigned int) a[start];
+      out[words++] = b;
+      unsigned int *packed = out + words;
+      int packed_words = RUN_LANES * b;
+      memset (packed, 0, packed_words * sizeof (unsigned int));
+      for (j = 0; j < RUN_BLOCK / RUN_LANES && b > 0; j++)
+	{
+	  int w = (j * b) >> 5, shift = (j * b) & 31;
+	  for (l = 0; l < RUN_LANES; l++)
+	    {
+	      unsigned int d = delta[RUN_LANES * j + l];
+	      packed[RUN_LANES * w + l] |= d << shift;
+	      if (shift + b > 32)
+		packed[RUN_LANES * (w + 1) + l] |= d >> (32 - shift);
+	    }
+	}
+      words += packed_words;
+    }
+  return words;
+}
+
+void decode_run (unsigned int in[], int size, int a[])
+{
+  unsigned int delta[RUN_BLOCK];
+  int start;
+  for (start = 0; start < size; start += RUN_BLOCK)
+    {
+      int n = size - start < RUN_BLOCK ? size - start : RUN_BLOCK;
+      unsigned int prev = *in++;
+      int b = *in++;
+      unsigned int mask = b == 32 ? ~0u : (1u << b) - 1;
+      int i, j, l;
+      for (j = 0; j < RUN_BLOCK / RUN_LANES; j++)
+	{
+	  int w = (j * b) >> 5, shift = (j * b) & 31;
+	  for (l = 0; l < RUN_LANES; l++)
+	    {
+	      unsigned int v = b > 0 ? in[RUN_LANES * w + l] >> shift : 0;
+	      if (shift + b > 32)
+		v |= in[RUN_LANES * (w + 1) + l] << (32 - shift);
+	      delta[RUN_LANES * j + l] = v & mask;
+	    }
+	}
+      for (i = 0; i < n; i++)
+	{
+	  prev += delta[i];
+	  a[start + i] = (int) prev;
+	}
+      in += RUN_LANES * b;
+    }
+}
+
+// Send a sorted run to the parent, encoded when compress_runs is set
+void send_run (int a[], int size, int dest, int tag, MPI_Comm comm)
+{
+  if (!compress_runs)
+    {
+      MPI_Send (a, size, MPI_INT, dest, tag, comm);
+      return;
+    }
+  unsigned int *buf =
+    (unsigned int *) malloc (sizeof (unsigned int) * run_encoded_words (size));
+  int words = encode_run (a, size, buf);
+  MPI_Send (buf, words, MPI_UNSIGNED, dest, tag, comm);
+  free (buf);
+}
+
+// Receive a sorted run from a helper, decoding straight into a
+void recv_run (int a[], int size, int source, int tag, MPI_Comm comm)
+{
+  MPI_Status status;
+  if (!compress_runs)
+    {
+      MPI_Recv (a, size, MPI_INT, source, tag, comm, &status);
+      return;
+    }
+  int words;
+  MPI_Probe (source, tag, comm, &status);
+  MPI_Get_count (&status, MPI_UNSIGNED, &words);
+  unsigned int *buf = (unsigned int *) malloc (sizeof (unsigned int) * words);
+  MPI_Recv (buf, words, MPI_UNSIGNED, source, tag, comm, &status);
+  decode_run (buf, size, a);
+  free (buf);
 }
 
 // OpenMP merge sort with given number of threads
@@ -212,7 +1097,7 @@ void mergesort_parallel_omp (int a[], int size, int temp[], int threads)
   if (threads == 1)
     {
      
-      mergesort_serial (a, size, temp);
+      local_sort (a, size, temp);
     }
   else if (threads > 1)
     {
@@ -234,10 +1119,154 @@ void mergesort_parallel_omp (int a[], int size, int temp[], int threads)
     }
 }
 
+// Single-threaded sort of one leaf with the selected algorithm
+void local_sort (int a[], int size, int temp[])
+{
+  if (local_algorithm == ALG_QSORT)
+    qsort (a, size, sizeof (int), compare_int);
+  else if (local_algorithm == ALG_MULTIWAY && size > CACHE_BLOCK)
+    mergesort_multiway (a, size, temp);
+  else
+    mergesort_serial (a, size, temp);
+}
+
+int compare_int (const void *x, const void *y)
+{
+  int u = *(const int *) x, v = *(const int *) y;
+  return (u > v) - (u < v);
+}
+
+const char *algorithm_name (int algorithm)
+{
+  return algorithm == ALG_QSORT ? "qsort"
+    : algorithm == ALG_MULTIWAY ? "multiway" : "mergesort";
+}
+
+// Cache-aware multiway mergesort.
+// Blocks of CACHE_BLOCK keys are sorted while they sit in cache; after that
+// each pass streams the array once, merging MERGE_WAYS runs through a loser
+// tree and ping-ponging between a and temp. That is log16 instead of log2
+// passes over DRAM, and no merge in this mode takes a data-dependent branch.
+void mergesort_multiway (int a[], int size, int temp[])
+{
+  int start, run = CACHE_BLOCK;
+  for (start = 0; start < size; start += run)
+    {
+      sort_block (a + start, size - start < run ? size - start : run,
+		  temp + start);
+    }
+  int *src = a, *dst = temp;
+  while (run < size)
+    {
+      long long group = (long long) run * MERGE_WAYS;
+      for (start = 0; start < size; start += group)
+	{
+	  int pos[MERGE_WAYS], end[MERGE_WAYS];
+	  int ways = 0, from = start;
+	  while (ways < MERGE_WAYS && from < size)
+	    {
+	      pos[ways] = from;
+	      from = size - from < run ? size : from + run;
+	      end[ways++] = from;
+	    }
+	  merge_runs (src, pos, end, ways, dst + start);
+	}
+      int *swap = src;
+      src = dst;
+      dst = swap;
+      run = group < size ? (int) group : size;
+    }
+  if (src != a)
+    memcpy (a, src, size * sizeof (int));
+}
+
+// Mergesort of one in-cache block. On random keys the branch in merge is
+// mispredicted about half the time, so the block merges pick the smaller
+// head with a mask instead.
+void sort_block (int a[], int size, int temp[])
+{
+  if (size <= small_cutoff)
+    {
+      insertion_sort (a, size);
+      return;
+    }
+  sort_block (a, size / 2, temp);
+  sort_block (a + size / 2, size - size / 2, temp);
+  int *l = a, *lend = a + size / 2, *r = lend, *rend = a + size, *o = temp;
+  while (l < lend && r < rend)
+    {
+      int x = *l, y = *r, take_r = y < x;
+      *o++ = x ^ ((x ^ y) & -take_r);
+      r += take_r;
+      l += !take_r;
+    }
+  while (l < lend)
+    *o++ = *l++;
+  while (r < rend)
+    *o++ = *r++;
+  memcpy (a, temp, size * sizeof (int));
+}
+
+// Merge src[pos[i]..end[i]) for i < ways into out with a loser tree:
+// tree[1..] holds the loser of each match and key[1..] its current head,
+// so replacing the winner replays one leaf-to-root path of log2(ways)
+// matches, each a compare and conditional moves against the winner's key
+// kept in a register. Keys are widened to 64 bits with LLONG_MAX for an
+// exhausted run.
+void merge_runs (int src[], int pos[], int end[], int ways, int out[])
+{
+  int tree[MERGE_WAYS], winner[2 * MERGE_WAYS];
+  long long key[MERGE_WAYS], head[2 * MERGE_WAYS];
+  int *cur[MERGE_WAYS], *stop[MERGE_WAYS];
+  int k = 1, i, node, total = 0;
+  while (k < ways)
+    k <<= 1;
+  for (i = 0; i < k; i++)
+    {
+      if (i >= ways)
+	pos[i] = end[i] = 0;
+      total += end[i] - pos[i];
+      cur[i] = src + pos[i];
+      stop[i] = src + end[i];
+      head[k + i] = pos[i] < end[i] ? src[pos[i]] : LLONG_MAX;
+      winner[k + i] = i;
+    }
+  // Build bottom-up: winners move up, losers stay in tree[1..k)
+  for (node = k - 1; node >= 1; node--)
+    {
+      int l = 2 * node, r = 2 * node + 1;
+      int l_wins = head[l] <= head[r];
+      winner[node] = l_wins ? winner[l] : winner[r];
+      head[node] = l_wins ? head[l] : head[r];
+      tree[node] = l_wins ? winner[r] : winner[l];
+      key[node] = l_wins ? head[r] : head[l];
+    }
+
+  int w = winner[1];
+  long long wkey = head[1];
+  int t;
+  for (t = 0; t < total; t++)
+    {
+      out[t] = (int) wkey;
+      int *next = ++cur[w];
+      wkey = next < stop[w] ? *next : LLONG_MAX;
+      for (node = (w + k) >> 1; node >= 1; node >>= 1)
+	{
+	  int l = tree[node];
+	  long long lkey = key[node];
+	  int l_wins = lkey < wkey;
+	  tree[node] = l_wins ? w : l;
+	  key[node] = l_wins ? wkey : lkey;
+	  w = l_wins ? l : w;
+	  wkey = l_wins ? lkey : wkey;
+	}
+    }
+}
+
 void mergesort_serial (int a[], int size, int temp[])
 {
   // Switch to insertion sort for small arrays
-  if (size <= SMALL)
+  if (size <= small_cutoff)
     {
       insertion_sort (a, size);
       return;
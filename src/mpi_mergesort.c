@@ -47,17 +47,63 @@ get_time(void)
 
 #define SMALL    32
 
+// Sorted-run codec block size (keys) and number of interleaved lanes
+#define RUN_BLOCK    128
+#define RUN_LANES    4
+
+// Set by -z: helpers send their sorted runs block bit-packed
+int compress_runs = 0;
+
+// Verification state of this process: the number of runs found out of
+// order or not matching what their sender sent, and the time spent checking
+long long run_bad = 0;
+double verify_time = 0.0;
+
+// Query modes; MODE_SORT is the default full sort
+#define MODE_SORT    0
+#define MODE_TOPK    1
+#define MODE_NTH     2
+#define MODE_PCT     3
+
 extern double get_time (void);
 void merge (int a[], int size, int temp[]);
 void insertion_sort (int a[], int size);
 void mergesort_serial (int a[], int size, int temp[]);
-void mergesort_parallel_mpi (int a[], int size, int temp[],
-			     int level, int my_rank, int max_rank,
-			     int tag, MPI_Comm comm);
+unsigned long long mergesort_parallel_mpi (int a[], int size, int temp[],
+					   int level, int my_rank,
+					   int max_rank, int tag,
+					   MPI_Comm comm);
 int my_topmost_level_mpi (int my_rank);
-void run_root_mpi (int a[], int size, int temp[], int max_rank, int tag,
-		   MPI_Comm comm);
+int run_encoded_words (int size);
+int encode_run (int a[], int size, unsigned int out[]);
+void decode_run (unsigned int in[], int size, int a[]);
+void send_run (int a[], int size, int dest, int tag, MPI_Comm comm);
+void recv_run (int a[], int size, int source, int tag, MPI_Comm comm);
+unsigned long long run_root_mpi (int a[], int size, int temp[],
+				 int max_rank, int tag, MPI_Comm comm);
 void run_helper_mpi (int my_rank, int max_rank, int tag, MPI_Comm comm);
+unsigned long long key_hash (int key);
+int select_key (long long i, int size);
+unsigned long long check_run (int a[], int size);
+unsigned long long merge_checked (int a[], int size, int temp[],
+				  unsigned long long expected);
+void send_run_stats (int a[], int size, unsigned long long hash, int dest,
+		     int tag, MPI_Comm comm);
+unsigned long long recv_run_stats (int a[], int size, int source, int tag,
+				   MPI_Comm comm);
+void verify_sorted_mpi (unsigned long long output_hash,
+			unsigned long long input_hash, MPI_Comm comm);
+int parse_select_mode (const char *name, const char *value, double *mode_arg);
+void run_select_mpi (int size, int mode, double mode_arg, int tag,
+		     MPI_Comm comm);
+int topk_mpi (int local[], int local_size, int k, int best[], int tag,
+	      MPI_Comm comm);
+int merge_smallest (int best[], int nbest, int in[], int nin, int k,
+		    int temp[]);
+int nth_element_mpi (int local[], int local_size, long long k, MPI_Comm comm);
+int weighted_median (int pairs[], int npairs);
+void quickselect (int a[], int size, int k);
+void three_way_partition (int a[], int size, int pivot, int *lt, int *eq);
 int main (int argc, char *argv[]);
 
 int main (int argc, char *argv[])
@@ -70,54 +116,79 @@ int main (int argc, char *argv[])
   MPI_Comm_rank (MPI_COMM_WORLD, &my_rank);
   int max_rank = comm_size - 1;
   int tag = 123;
- 
-  if (my_rank == 0)
-    {				
-      puts ("-MPI Recursive Mergesort-\t");
-    
-      if (argc != 2)	
-	{
-	  printf ("Usage: %s array-size\n", argv[0]);
-	  MPI_Abort (MPI_COMM_WORLD, 1);
-	}
-    
-      int size = atoi (argv[1]);	
-      printf ("Array size = %d\nProcesses = %d\n", size, comm_size);
-      
-      int *a = malloc (sizeof (int) * size);
-      int *temp = malloc (sizeof (int) * size);
-      if (a == NULL || temp == NULL)
-	{
-	  printf ("Error: Could not allocate array of size %d\n", size);
-	  MPI_Abort (MPI_COMM_WORLD, 1);
-	}
-    
-      srand (314159);
-      int i;
-      for (i = 0; i < size; i++)
+  int mode = MODE_SORT;
+  double mode_arg = 0.0;
+  int argi = 2;
+
+  if (argc > argi && strcmp (argv[argi], "-z") == 0)
+    {
+      compress_runs = 1;
+      argi++;
+    }
+  if (argc == argi + 2)
+    {
+      mode = parse_select_mode (argv[argi], argv[argi + 1], &mode_arg);
+    }
+  if ((argc != argi && argc != argi + 2) || mode < 0)
+    {
+      if (my_rank == 0)
 	{
-	  a[i] = rand () % size;
+	  printf ("Usage: %s array-size [-z] [topk k | nth k | pct percentile]\n",
+		  argv[0]);
 	}
-    
-      double start = get_time ();
-      run_root_mpi (a, size, temp, max_rank, tag, MPI_COMM_WORLD);
-      double end = get_time ();
-      printf ("Start = %.2f\nEnd = %.2f\nElapsed = %.2f\n",
-	      start, end, end - start);
-     
-      for (i = 1; i < size; i++)
+      MPI_Abort (MPI_COMM_WORLD, 1);
+    }
+  if (compress_runs && mode != MODE_SORT)
+    {
+      if (my_rank == 0)
+	printf ("Error: -z only applies to the sort; selection sends no runs\n");
+      MPI_Abort (MPI_COMM_WORLD, 1);
+    }
+ 
+  if (mode != MODE_SORT)
+    {
+      run_select_mpi (atoi (argv[1]), mode, mode_arg, tag, MPI_COMM_WORLD);
+    }
+  else
+    {
+      int size = atoi (argv[1]);
+      int *a = NULL;
+      unsigned long long input_hash = 0, output_hash = 0;
+      if (my_rank == 0)
 	{
-	  if (!(a[i - 1] <= a[i]))
+	  puts ("-MPI Recursive Mergesort-\t");
+	  printf ("Array size = %d\nProcesses = %d\n", size, comm_size);
+
+	  a = malloc (sizeof (int) * size);
+	  int *temp = malloc (sizeof (int) * size);
+	  if (a == NULL || temp == NULL)
 	    {
-	      printf ("Implementation error: a[%d]=%d > a[%d]=%d\n", i - 1,
-		      a[i - 1], i, a[i]);
+	      printf ("Error: Could not allocate array of size %d\n", size);
 	      MPI_Abort (MPI_COMM_WORLD, 1);
 	    }
+
+	  srand (314159);
+	  int i;
+	  for (i = 0; i < size; i++)
+	    {
+	      a[i] = rand () % size;
+	      input_hash += key_hash (a[i]);
+	    }
+
+	  double start = get_time ();
+	  output_hash = run_root_mpi (a, size, temp, max_rank, tag,
+				      MPI_COMM_WORLD);
+	  double end = get_time ();
+	  printf ("Start = %.2f\nEnd = %.2f\nElapsed = %.2f\n",
+		  start, end, end - start);
+	  free (temp);
 	}
-    }				
-  else
-    {				
-      run_helper_mpi (my_rank, max_rank, tag, MPI_COMM_WORLD);
+      else
+	{
+	  run_helper_mpi (my_rank, max_rank, tag, MPI_COMM_WORLD);
+	}
+      verify_sorted_mpi (output_hash, input_hash, MPI_COMM_WORLD);
+      free (a);
     }
   fflush (stdout);
   MPI_Finalize ();
@@ -125,7 +196,7 @@ int main (int argc, char *argv[])
 }
 
 // Root process code
-void run_root_mpi (int a[], int size, int temp[], int max_rank, int tag,MPI_Comm comm)
+unsigned long long run_root_mpi (int a[], int size, int temp[], int max_rank, int tag,MPI_Comm comm)
 {
   int my_rank;
   MPI_Comm_rank (comm, &my_rank);
@@ -134,9 +205,8 @@ void run_root_mpi (int a[], int size, int temp[], int max_rank, int tag,MPI_Comm
       printf("Error: run_root_mpi called from process %d; must be called from process 0 only\n",my_rank);
       MPI_Abort (MPI_COMM_WORLD, 1);
     }
-  mergesort_parallel_mpi (a, size, temp, 0, my_rank, max_rank, tag, comm);
- 
-  return;
+  return mergesort_parallel_mpi (a, size, temp, 0, my_rank, max_rank, tag,
+				 comm);
 }
 
 
@@ -153,12 +223,470 @@ void run_helper_mpi (int my_rank, int max_rank, int tag, MPI_Comm comm)
   int *a = malloc (sizeof (int) * size);
   int *temp = malloc (sizeof (int) * size);
   MPI_Recv (a, size, MPI_INT, parent_rank, tag, comm, &status);
-  mergesort_parallel_mpi (a, size, temp, level, my_rank, max_rank, tag, comm);
-  // Send sorted array to parent process
-  MPI_Send (a, size, MPI_INT, parent_rank, tag, comm);
+  unsigned long long hash =
+    mergesort_parallel_mpi (a, size, temp, level, my_rank, max_rank, tag, comm);
+  // Send sorted array to parent process, then what it should find in it
+  send_run (a, size, parent_rank, tag, comm);
+  send_run_stats (a, size, hash, parent_rank, tag, comm);
+  free (temp);
+  free (a);
   return;
 }
 
+// Order-independent multiset fingerprint: the sum of a 64-bit mix of each
+// key, so a lost, duplicated or altered key changes the total
+unsigned long long key_hash (int key)
+{
+  unsigned long long z = (unsigned int) key + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Check a run where it is: return the sum of its key hashes and count it
+// in run_bad if any neighbours are out of order
+unsigned long long check_run (int a[], int size)
+{
+  double start = get_time ();
+  unsigned long long hash = 0;
+  int i, bad = 0;
+  for (i = 0; i < size; i++)
+    {
+      hash += key_hash (a[i]);
+      bad |= i > 0 && a[i - 1] > a[i];
+    }
+  run_bad += bad;
+  verify_time += get_time () - start;
+  return hash;
+}
+
+// Merge the two sorted halves of a process-tree node, hashing every key
+// as it is emitted and checking it against the one before. expected is
+// the sum of the halves' hashes, each taken from the data itself, so a
+// key lost, duplicated or altered by the merge shows up as a mismatch.
+// Returns the hash of the merged run.
+unsigned long long merge_checked (int a[], int size, int temp[],
+				  unsigned long long expected)
+{
+  unsigned long long hash = 0;
+  int i1 = 0, i2 = size / 2, tempi = 0, bad = 0;
+  while (i1 < size / 2 || i2 < size)
+    {
+      if (i2 == size || (i1 < size / 2 && a[i1] < a[i2]))
+	temp[tempi] = a[i1++];
+      else
+	temp[tempi] = a[i2++];
+      hash += key_hash (temp[tempi]);
+      bad |= tempi > 0 && temp[tempi - 1] > temp[tempi];
+      tempi++;
+    }
+  memcpy (a, temp, size * sizeof (int));
+  run_bad += bad || hash != expected;
+  return hash;
+}
+
+// A helper's run is followed by what its parent should find in it: the
+// hash of the keys, the first and last key, and the helper's error count
+void send_run_stats (int a[], int size, unsigned long long hash, int dest,
+		     int tag, MPI_Comm comm)
+{
+  unsigned long long stats[4] = { hash, (unsigned long long) run_bad, 0, 0 };
+  if (size > 0)
+    {
+      stats[2] = (unsigned int) a[0];
+      stats[3] = (unsigned int) a[size - 1];
+    }
+  MPI_Send (stats, 4, MPI_UNSIGNED_LONG_LONG, dest, tag, comm);
+}
+
+// Check a run on the receiving side, after any decoding: its order, its
+// hash and its boundary keys must match what the helper sent. Returns the
+// hash of the keys actually received.
+unsigned long long recv_run_stats (int a[], int size, int source, int tag,
+				   MPI_Comm comm)
+{
+  unsigned long long stats[4];
+  MPI_Recv (stats, 4, MPI_UNSIGNED_LONG_LONG, source, tag, comm,
+	    MPI_STATUS_IGNORE);
+  unsigned long long hash = check_run (a, size);
+  run_bad += (long long) stats[1];
+  if (hash != stats[0]
+      || (size > 0 && (a[0] != (int) stats[2] || a[size - 1] != (int) stats[3])))
+    run_bad++;
+  return hash;
+}
+
+// Result of the verification, called by every process. Leaf runs were
+// checked where they were sorted, every run again where it was received
+// and every merge as it was made; rank 0 holds the errors gathered up the
+// process tree and the hash of the final array, which must equal the hash
+// it took of the input. The time is that of the slowest process's checks.
+void verify_sorted_mpi (unsigned long long output_hash,
+			unsigned long long input_hash, MPI_Comm comm)
+{
+  int my_rank;
+  double slowest;
+  MPI_Comm_rank (comm, &my_rank);
+  MPI_Reduce (&verify_time, &slowest, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+  if (my_rank != 0)
+    return;
+  printf ("Verify = %.2f\n", slowest);
+  if (run_bad > 0)
+    {
+      printf ("Implementation error: %lld failed checks of sorted, received "
+	      "and merged runs\n", run_bad);
+      MPI_Abort (MPI_COMM_WORLD, 1);
+    }
+  if (output_hash != input_hash)
+    {
+      printf ("Implementation error: output is not a permutation of the "
+	      "input (hash %016llx, expected %016llx)\n",
+	      output_hash, input_hash);
+      MPI_Abort (MPI_COMM_WORLD, 1);
+    }
+  puts ("-Success-");
+}
+
+// Map "topk k", "nth k" or "pct percentile" to a query mode; -1 if invalid
+int parse_select_mode (const char *name, const char *value, double *mode_arg)
+{
+  char *end;
+  *mode_arg = strtod (value, &end);
+  if (*end != '\0' || *mode_arg < 0)
+    return -1;
+  if (strcmp (name, "topk") == 0)
+    return *mode_arg >= 1 ? MODE_TOPK : -1;
+  if (strcmp (name, "nth") == 0)
+    return MODE_NTH;
+  if (strcmp (name, "pct") == 0)
+    return *mode_arg <= 100 ? MODE_PCT : -1;
+  return -1;
+}
+
+// Selection query code, run by every process.
+// Each process generates its own share of the input with select_key, so
+// no keys cross the network up front; afterwards only O(k) keys (top-k) or
+// O(processes) keys per round (nth, percentile) do. The result is checked
+// by counting the keys below it where they are.
+void run_select_mpi (int size, int mode, double mode_arg, int tag,
+		     MPI_Comm comm)
+{
+  int my_rank, comm_size;
+  MPI_Comm_rank (comm, &my_rank);
+  MPI_Comm_size (comm, &comm_size);
+  int i;
+  if (my_rank == 0)
+    {
+      puts ("-MPI Distributed Selection-\t");
+      printf ("Array size = %d\nProcesses = %d\n", size, comm_size);
+    }
+  if (size < 1)
+    {
+      if (my_rank == 0)
+	printf ("Error: selection needs a non-empty array\n");
+      MPI_Abort (MPI_COMM_WORLD, 1);
+    }
+
+  long long first = (long long) size * my_rank / comm_size;
+  int local_size = (int) ((long long) size * (my_rank + 1) / comm_size - first);
+  int *local = malloc (sizeof (int) * (local_size > 0 ? local_size : 1));
+  if (local == NULL)
+    {
+      printf ("Error: Could not allocate array of size %d\n", local_size);
+      MPI_Abort (MPI_COMM_WORLD, 1);
+    }
+
+  MPI_Barrier (comm);
+  double start = get_time ();
+  for (i = 0; i < local_size; i++)
+    local[i] = select_key (first + i, size);
+  long long k;
+  int value, nbest = 0;
+  int *best = NULL;
+  if (mode == MODE_TOPK)
+    {
+      k = mode_arg < size ? (int) mode_arg : size;
+      best = malloc (sizeof (int) * k);
+      nbest = topk_mpi (local, local_size, (int) k, best, tag, comm);
+      value = best[nbest > 0 ? nbest - 1 : 0];
+    }
+  else
+    {
+      if (mode == MODE_NTH)
+	{
+	  k = (long long) mode_arg;
+	}
+      else
+	{
+	  // Nearest-rank percentile
+	  k = (long long) ceil (mode_arg / 100.0 * size) - 1;
+	}
+      if (k < 0)
+	k = 0;
+      if (k >= size)
+	k = size - 1;
+      value = nth_element_mpi (local, local_size, k, comm);
+    }
+  double end = get_time ();
+  if (my_rank == 0)
+    {
+      printf ("Start = %.2f\nEnd = %.2f\nElapsed = %.2f\n",
+	      start, end, end - start);
+      if (mode == MODE_TOPK)
+	{
+	  printf ("Smallest %d keys:", nbest);
+	  for (i = 0; i < nbest && i < 10; i++)
+	    printf (" %d", best[i]);
+	  printf ("%s\n", nbest > 10 ? " ..." : "");
+	}
+      else if (mode == MODE_PCT)
+	printf ("Percentile %g = %d (k = %lld)\n", mode_arg, value, k);
+      else
+	printf ("Element %lld = %d\n", k, value);
+    }
+
+  // Fewer than k + 1 keys (k for top-k) are below the answer and more
+  // are at or below it; the shares are regenerated since selection
+  // reordered them
+  MPI_Bcast (&value, 1, MPI_INT, 0, comm);
+  long long mine[2] = { 0, 0 }, counts[2];
+  for (i = 0; i < local_size; i++)
+    {
+      int key = select_key (first + i, size);
+      mine[0] += key < value;
+      mine[1] += key <= value;
+    }
+  MPI_Reduce (mine, counts, 2, MPI_LONG_LONG, MPI_SUM, 0, comm);
+  if (my_rank == 0)
+    {
+      if (mode == MODE_TOPK)
+	{
+	  for (i = 1; i < nbest; i++)
+	    {
+	      if (!(best[i - 1] <= best[i]))
+		break;
+	    }
+	  if (nbest != k || i < nbest || counts[0] >= k || counts[1] < k)
+	    {
+	      printf ("Implementation error: top-%lld ends at %d\n", k, value);
+	      MPI_Abort (MPI_COMM_WORLD, 1);
+	    }
+	}
+      else if (counts[0] > k || counts[1] <= k)
+	{
+	  printf ("Implementation error: element %lld is not %d\n", k, value);
+	  MPI_Abort (MPI_COMM_WORLD, 1);
+	}
+    }
+  free (best);
+  free (local);
+  return;
+}
+
+// Key i of the selection input, uniform in [0, size): a 64-bit mix of the
+// index alone, so every process can generate its share of the array
+int select_key (long long i, int size)
+{
+  unsigned long long z = (unsigned long long) i + 314159 * 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return (int) ((z ^ (z >> 31)) % (unsigned long long) size);
+}
+
+// Distributed top-k: each process keeps its k smallest keys (quickselect
+// plus a sort of just those k), then a binomial tree merges candidate lists,
+// so every message carries at most k keys. Result is valid on rank 0.
+int topk_mpi (int local[], int local_size, int k, int best[], int tag,
+	      MPI_Comm comm)
+{
+  int my_rank, comm_size;
+  MPI_Comm_rank (comm, &my_rank);
+  MPI_Comm_size (comm, &comm_size);
+  int nbest = local_size < k ? local_size : k;
+  int *in = malloc (sizeof (int) * k);
+  int *temp = malloc (sizeof (int) * k);
+
+  if (nbest > 0)
+    quickselect (local, local_size, nbest - 1);
+  memcpy (best, local, nbest * sizeof (int));
+  mergesort_serial (best, nbest, temp);
+
+  int step;
+  for (step = 1; step < comm_size; step <<= 1)
+    {
+      if (my_rank & step)
+	{
+	  MPI_Send (best, nbest, MPI_INT, my_rank - step, tag, comm);
+	  break;
+	}
+      if (my_rank + step < comm_size)
+	{
+	  MPI_Status status;
+	  int nin;
+	  MPI_Recv (in, k, MPI_INT, my_rank + step, tag, comm, &status);
+	  MPI_Get_count (&status, MPI_INT, &nin);
+	  nbest = merge_smallest (best, nbest, in, nin, k, temp);
+	}
+    }
+  free (temp);
+  free (in);
+  return nbest;
+}
+
+// Merge two sorted runs into best, keeping only the k smallest keys
+int merge_smallest (int best[], int nbest, int in[], int nin, int k,
+		    int temp[])
+{
+  int i1 = 0, i2 = 0, tempi = 0;
+  while (tempi < k && (i1 < nbest || i2 < nin))
+    {
+      if (i2 == nin || (i1 < nbest && best[i1] <= in[i2]))
+	temp[tempi++] = best[i1++];
+      else
+	temp[tempi++] = in[i2++];
+    }
+  memcpy (best, temp, tempi * sizeof (int));
+  return tempi;
+}
+
+// Distributed selection of the k-th smallest key (0-based).
+// Each round every process proposes the median of its live keys, the
+// weighted median of the proposals becomes the pivot, and one allreduce of
+// the (<, ==) counts tells all processes which side to keep. At least a
+// quarter of the live keys is discarded per round.
+int nth_element_mpi (int local[], int local_size, long long k, MPI_Comm comm)
+{
+  int comm_size;
+  MPI_Comm_size (comm, &comm_size);
+  int *pairs = malloc (sizeof (int) * 2 * comm_size);
+  int lo = 0, hi = local_size;
+  int pivot;
+  while (1)
+    {
+      int mine[2] = { 0, hi - lo };
+      if (hi > lo)
+	{
+	  int mid = (hi - lo) / 2;
+	  quickselect (local + lo, hi - lo, mid);
+	  mine[0] = local[lo + mid];
+	}
+      MPI_Allgather (mine, 2, MPI_INT, pairs, 2, MPI_INT, comm);
+      pivot = weighted_median (pairs, comm_size);
+
+      int lt, eq;
+      three_way_partition (local + lo, hi - lo, pivot, &lt, &eq);
+      long long mine_counts[2] = { lt, eq }, counts[2];
+      MPI_Allreduce (mine_counts, counts, 2, MPI_LONG_LONG, MPI_SUM, comm);
+      if (k < counts[0])
+	{
+	  hi = lo + lt;
+	}
+      else if (k < counts[0] + counts[1])
+	{
+	  break;
+	}
+      else
+	{
+	  k -= counts[0] + counts[1];
+	  lo += lt + eq;
+	}
+    }
+  free (pairs);
+  return pivot;
+}
+
+// pairs holds (value, weight) per process; return the weighted median value
+int weighted_median (int pairs[], int npairs)
+{
+  int i, j;
+  long long total = 0;
+  // Insertion sort by value; npairs is the number of processes
+  for (i = 1; i < npairs; i++)
+    {
+      int v = pairs[2 * i], w = pairs[2 * i + 1];
+      for (j = i - 1; j >= 0 && pairs[2 * j] > v; j--)
+	{
+	  pairs[2 * j + 2] = pairs[2 * j];
+	  pairs[2 * j + 3] = pairs[2 * j + 1];
+	}
+      pairs[2 * j + 2] = v;
+      pairs[2 * j + 3] = w;
+    }
+  for (i = 0; i < npairs; i++)
+    total += pairs[2 * i + 1];
+  long long seen = 0;
+  for (i = 0; i < npairs; i++)
+    {
+      seen += pairs[2 * i + 1];
+      if (pairs[2 * i + 1] > 0 && 2 * seen >= total)
+	return pairs[2 * i];
+    }
+  return pairs[0];
+}
+
+// Rearrange a so that a[k] holds the k-th smallest key, with no larger key
+// before it and no smaller key after it
+void quickselect (int a[], int size, int k)
+{
+  int lo = 0, hi = size - 1;
+  while (hi - lo > SMALL)
+    {
+      int mid = lo + (hi - lo) / 2;
+      int x = a[lo], y = a[mid], z = a[hi];
+      int pivot = x < y ? (y < z ? y : (x < z ? z : x))
+	: (x < z ? x : (y < z ? z : y));
+      int i = lo, j = hi;
+      while (i <= j)
+	{
+	  while (a[i] < pivot)
+	    i++;
+	  while (a[j] > pivot)
+	    j--;
+	  if (i <= j)
+	    {
+	      int t = a[i];
+	      a[i] = a[j];
+	      a[j] = t;
+	      i++;
+	      j--;
+	    }
+	}
+      if (k <= j)
+	hi = j;
+      else if (k >= i)
+	lo = i;
+      else
+	return;
+    }
+  insertion_sort (a + lo, hi - lo + 1);
+}
+
+// Dutch national flag partition: [0, lt) < pivot, [lt, lt + eq) == pivot
+void three_way_partition (int a[], int size, int pivot, int *lt, int *eq)
+{
+  int l = 0, i = 0, g = size;
+  while (i < g)
+    {
+      int v = a[i];
+      if (v < pivot)
+	{
+	  a[i++] = a[l];
+	  a[l++] = v;
+	}
+      else if (v > pivot)
+	{
+	  a[i] = a[--g];
+	  a[g] = v;
+	}
+      else
+	{
+	  i++;
+	}
+    }
+  *lt = l;
+  *eq = g - l;
+}
+
 // Given a process rank, calculate the top level of the process tree in which the process participates
 // Root assumed to always have rank 0 and to participate at level 0 of the process tree
 int my_topmost_level_mpi (int my_rank)
@@ -169,32 +697,151 @@ int my_topmost_level_mpi (int my_rank)
   return level;
 }
 
-void mergesort_parallel_mpi (int a[], int size, int temp[],	int level, int my_rank, int max_rank,int tag, MPI_Comm comm)
+// Returns the hash of the sorted keys, taken from the data
+unsigned long long mergesort_parallel_mpi (int a[], int size, int temp[],	int level, int my_rank, int max_rank,int tag, MPI_Comm comm)
 {
   int helper_rank = my_rank + pow (2, level);
   if (helper_rank > max_rank)
     {				// no more processes available
       mergesort_serial (a, size, temp);
+      return check_run (a, size);
     }
   else
     {
 
       MPI_Request request;
-      MPI_Status status;
       // Send second half, asynchronous
       MPI_Isend (a + size / 2, size - size / 2, MPI_INT, helper_rank, tag,
 		 comm, &request);
       // Sort first half
-      mergesort_parallel_mpi (a, size / 2, temp, level + 1, my_rank, max_rank,
-			      tag, comm);
+      unsigned long long hash =
+	mergesort_parallel_mpi (a, size / 2, temp, level + 1, my_rank,
+				max_rank, tag, comm);
       // Free the async request (matching receive will complete the transfer).
       MPI_Request_free (&request);
-      // Receive second half sorted
-      MPI_Recv (a + size / 2, size - size / 2, MPI_INT, helper_rank, tag,
-		comm, &status);
-      merge (a, size, temp);
+      // Receive second half sorted, and check it here
+      recv_run (a + size / 2, size - size / 2, helper_rank, tag, comm);
+      hash += recv_run_stats (a + size / 2, size - size / 2, helper_rank, tag,
+			      comm);
+      return merge_checked (a, size, temp, hash);
     }
-  return;
+}
+
+// Sorted-run codec for the helper -> parent transfers.
+// Runs are cut into blocks of RUN_BLOCK keys; a block is stored as its
+// first key, a bit width b, and the neighbour deltas packed at b bits.
+// Delta i goes to lane i % RUN_LANES and lanes are interleaved word by word,
+// so packing and unpacking run the lanes in lockstep (SIMD-BP128 layout).
+// Deltas are taken modulo 2^32, so unsorted input still round-trips.
+int run_encoded_words (int size)
+{
+  int blocks = (size + RUN_BLOCK - 1) / RUN_BLOCK;
+  return blocks * (2 + RUN_BLOCK);
+}
+
+int encode_run (int a[], int size, unsigned int out[])
+{
+  unsigned int delta[RUN_BLOCK];
+  int words = 0;
+  int start;
+  for (start = 0; start < size; start += RUN_BLOCK)
+    {
+      int n = size - start < RUN_BLOCK ? size - start : RUN_BLOCK;
+      unsigned int prev = (unsigned int) a[start], any = 0;
+      int i, j, l;
+      for (i = 0; i < RUN_BLOCK; i++)
+	{
+	  unsigned int v = i < n ? (unsigned int) a[start + i] : prev;
+	  delta[i] = v - prev;
+	  any |= delta[i];
+	  prev = v;
+	}
+      int b = 0;
+      while (b < 32 && (any >> b) != 0)
+	b++;
+      out[words++] = (unsigned int) a[start];
+      out[words++] = b;
+      unsigned int *packed = out + words;
+      int packed_words = RUN_LANES * b;
+      memset (packed, 0, packed_words * sizeof (unsigned int));
+      for (j = 0; j < RUN_BLOCK / RUN_LANES && b > 0; j++)
+	{
+	  int w = (j * b) >> 5, shift = (j * b) & 31;
+	  for (l = 0; l < RUN_LANES; l++)
+	    {
+	      unsigned int d = delta[RUN_LANES * j + l];
+	      packed[RUN_LANES * w + l] |= d << shift;
+	      if (shift + b > 32)
+		packed[RUN_LANES * (w + 1) + l] |= d >> (32 - shift);
+	    }
+	}
+      words += packed_words;
+    }
+  return words;
+}
+
+void decode_run (unsigned int in[], int size, int a[])
+{
+  unsigned int delta[RUN_BLOCK];
+  int start;
+  for (start = 0; start < size; start += RUN_BLOCK)
+    {
+      int n = size - start < RUN_BLOCK ? size - start : RUN_BLOCK;
+      unsigned int prev = *in++;
+      int b = *in++;
+      unsigned int mask = b == 32 ? ~0u : (1u << b) - 1;
+      int i, j, l;
+      for (j = 0; j < RUN_BLOCK / RUN_LANES; j++)
+	{
+	  int w = (j * b) >> 5, shift = (j * b) & 31;
+	  for (l = 0; l < RUN_LANES; l++)
+	    {
+	      unsigned int v = b > 0 ? in[RUN_LANES * w + l] >> shift : 0;
+	      if (shift + b > 32)
+		v |= in[RUN_LANES * (w + 1) + l] << (32 - shift);
+	      delta[RUN_LANES * j + l] = v & mask;
+	    }
+	}
+      for (i = 0; i < n; i++)
+	{
+	  prev += delta[i];
+	  a[start + i] = (int) prev;
+	}
+      in += RUN_LANES * b;
+    }
+}
+
+// Send a sorted run to the parent, encoded when compress_runs is set
+void send_run (int a[], int size, int dest, int tag, MPI_Comm comm)
+{
+  if (!compress_runs)
+    {
+      MPI_Send (a, size, MPI_INT, dest, tag, comm);
+      return;
+    }
+  unsigned int *buf =
+    (unsigned int *) malloc (sizeof (unsigned int) * run_encoded_words (size));
+  int words = encode_run (a, size, buf);
+  MPI_Send (buf, words, MPI_UNSIGNED, dest, tag, comm);
+  free (buf);
+}
+
+// Receive a sorted run from a helper, decoding straight into a
+void recv_run (int a[], int size, int source, int tag, MPI_Comm comm)
+{
+  MPI_Status status;
+  if (!compress_runs)
+    {
+      MPI_Recv (a, size, MPI_INT, source, tag, comm, &status);
+      return;
+    }
+  int words;
+  MPI_Probe (source, tag, comm, &status);
+  MPI_Get_count (&status, MPI_UNSIGNED, &words);
+  unsigned int *buf = (unsigned int *) malloc (sizeof (unsigned int) * words);
+  MPI_Recv (buf, words, MPI_UNSIGNED, source, tag, comm, &status);
+  decode_run (buf, size, a);
+  free (buf);
 }
 
 void mergesort_serial (int a[], int size, int temp[])
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <omp.h>
 #if _POSIX_TIMERS
 #include <time.h>
@@ -46,21 +47,40 @@ get_time(void)
 
 #define SMALL    32
 
+// Cache-aware multiway mode: sort blocks of CACHE_BLOCK keys (block plus
+// temp take half of a 2 MiB L2), then merge up to MERGE_WAYS runs per pass
+#define CACHE_BLOCK    (1 << 17)
+#define MERGE_WAYS     16
+
+// Set by -m: mergesort_serial switches to the multiway mode above CACHE_BLOCK
+int multiway_sort = 0;
+
 extern double get_time (void);
 void merge (int a[], int size, int temp[]);
 void insertion_sort (int a[], int size);
 void mergesort_serial (int a[], int size, int temp[]);
+void mergesort_multiway (int a[], int size, int temp[]);
+void sort_block (int a[], int size, int temp[]);
+void merge_runs (int src[], int pos[], int end[], int ways, int out[]);
 void mergesort_parallel_omp (int a[], int size, int temp[], int threads);
 void run_omp (int a[], int size, int temp[], int threads);
+unsigned long long key_hash (int key);
+long long verify_range_omp (int a[], int size, unsigned long long *hash,
+			    int threads);
 int main (int argc, char *argv[]);
 
 int main (int argc, char *argv[])
 {
   puts ("-OpenMP Recursive Mergesort-\t");
  
+  if (argc == 4 && strcmp (argv[3], "-m") == 0)
+    {
+      multiway_sort = 1;
+      argc--;
+    }
   if (argc != 3)	
     {
-      printf ("Usage: %s array-size number-of-threads\n", argv[0]);
+      printf ("Usage: %s array-size number-of-threads [-m]\n", argv[0]);
       return 1;
     }
   int size = atoi (argv[1]);	
@@ -93,10 +113,12 @@ int main (int argc, char *argv[])
       return 1;
     }
   int i;
+  unsigned long long input_hash = 0, output_hash;
   srand (314159);
   for (i = 0; i < size; i++)
     {
       a[i] = rand () % size;
+      input_hash += key_hash (a[i]);
     }
 
   double start = get_time ();
@@ -105,14 +127,21 @@ int main (int argc, char *argv[])
   printf ("Start = %.2f\nEnd = %.2f\nElapsed = %.2f\n",
 	  start, end, end - start);
   
-  for (i = 1; i < size; i++)
+  start = get_time ();
+  long long bad = verify_range_omp (a, size, &output_hash, threads);
+  printf ("Verify = %.2f\n", get_time () - start);
+  if (bad < size)
     {
-      if (!(a[i - 1] <= a[i]))
-	{
-	  printf ("Implementation error: a[%d]=%d > a[%d]=%d\n", i - 1,
-		  a[i - 1], i, a[i]);
-	  return 1;
-	}
+      printf ("Implementation error: a[%lld]=%d > a[%lld]=%d\n", bad - 1,
+	      a[bad - 1], bad, a[bad]);
+      return 1;
+    }
+  if (output_hash != input_hash)
+    {
+      printf ("Implementation error: output is not a permutation of the "
+	      "input (hash %016llx, expected %016llx)\n",
+	      output_hash, input_hash);
+      return 1;
     }
   puts ("-Success-");
   return 0;
@@ -125,6 +154,35 @@ void run_omp (int a[], int size, int temp[], int threads)
   mergesort_parallel_omp (a, size, temp, threads);
 }
 
+// Order-independent multiset fingerprint: the sum of a 64-bit mix of each
+// key, so a lost, duplicated or altered key changes the total
+unsigned long long key_hash (int key)
+{
+  unsigned long long z = (unsigned int) key + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Hash a[0..size) and return the first index i with a[i - 1] > a[i], or
+// size if the range is sorted. Threads split the range; the check at each
+// index looks one key back, so thread boundaries are covered.
+long long verify_range_omp (int a[], int size, unsigned long long *hash,
+			    int threads)
+{
+  unsigned long long h = 0;
+  long long first_bad = size;
+  int i;
+#pragma omp parallel for num_threads(threads) reduction(+:h) reduction(min:first_bad)
+  for (i = 0; i < size; i++)
+    {
+      h += key_hash (a[i]);
+      if (i > 0 && a[i - 1] > a[i] && i < first_bad)
+	first_bad = i;
+    }
+  *hash = h;
+  return first_bad;
+}
 
 void mergesort_parallel_omp (int a[], int size, int temp[], int threads)
 {
@@ -159,7 +217,11 @@ void mergesort_parallel_omp (int a[], int size, int temp[], int threads)
 
 void mergesort_serial (int a[], int size, int temp[])
 {
-
+  if (multiway_sort && size > CACHE_BLOCK)
+    {
+      mergesort_multiway (a, size, temp);
+      return;
+    }
   if (size <= SMALL)
     {
       insertion_sort (a, size);
@@ -170,6 +232,127 @@ void mergesort_serial (int a[], int size, int temp[])
   merge (a, size, temp);
 }
 
+// Cache-aware multiway mergesort.
+// Blocks of CACHE_BLOCK keys are sorted while they sit in cache; after that
+// each pass streams the array once, merging MERGE_WAYS runs through a loser
+// tree and ping-ponging between a and temp. That is log16 instead of log2
+// passes over DRAM, and no merge in this mode takes a data-dependent branch.
+void mergesort_multiway (int a[], int size, int temp[])
+{
+  int start, run = CACHE_BLOCK;
+  for (start = 0; start < size; start += run)
+    {
+      sort_block (a + start, size - start < run ? size - start : run,
+		  temp + start);
+    }
+  int *src = a, *dst = temp;
+  while (run < size)
+    {
+      long long group = (long long) run * MERGE_WAYS;
+      for (start = 0; start < size; start += group)
+	{
+	  int pos[MERGE_WAYS], end[MERGE_WAYS];
+	  int ways = 0, from = start;
+	  while (ways < MERGE_WAYS && from < size)
+	    {
+	      pos[ways] = from;
+	      from = size - from < run ? size : from + run;
+	      end[ways++] = from;
+	    }
+	  merge_runs (src, pos, end, ways, dst + start);
+	}
+      int *swap = src;
+      src = dst;
+      dst = swap;
+      run = group < size ? (int) group : size;
+    }
+  if (src != a)
+    memcpy (a, src, size * sizeof (int));
+}
+
+// Mergesort of one in-cache block. On random keys the branch in merge is
+// mispredicted about half the time, so the block merges pick the smaller
+// head with a mask instead.
+void sort_block (int a[], int size, int temp[])
+{
+  if (size <= SMALL)
+    {
+      insertion_sort (a, size);
+      return;
+    }
+  sort_block (a, size / 2, temp);
+  sort_block (a + size / 2, size - size / 2, temp);
+  int *l = a, *lend = a + size / 2, *r = lend, *rend = a + size, *o = temp;
+  while (l < lend && r < rend)
+    {
+      int x = *l, y = *r, take_r = y < x;
+      *o++ = x ^ ((x ^ y) & -take_r);
+      r += take_r;
+      l += !take_r;
+    }
+  while (l < lend)
+    *o++ = *l++;
+  while (r < rend)
+    *o++ = *r++;
+  memcpy (a, temp, size * sizeof (int));
+}
+
+// Merge src[pos[i]..end[i]) for i < ways into out with a loser tree:
+// tree[1..] holds the loser of each match and key[1..] its current head,
+// so replacing the winner replays one leaf-to-root path of log2(ways)
+// matches, each a compare and conditional moves against the winner's key
+// kept in a register. Keys are widened to 64 bits with LLONG_MAX for an
+// exhausted run.
+void merge_runs (int src[], int pos[], int end[], int ways, int out[])
+{
+  int tree[MERGE_WAYS], winner[2 * MERGE_WAYS];
+  long long key[MERGE_WAYS], head[2 * MERGE_WAYS];
+  int *cur[MERGE_WAYS], *stop[MERGE_WAYS];
+  int k = 1, i, node, total = 0;
+  while (k < ways)
+    k <<= 1;
+  for (i = 0; i < k; i++)
+    {
+      if (i >= ways)
+	pos[i] = end[i] = 0;
+      total += end[i] - pos[i];
+      cur[i] = src + pos[i];
+      stop[i] = src + end[i];
+      head[k + i] = pos[i] < end[i] ? src[pos[i]] : LLONG_MAX;
+      winner[k + i] = i;
+    }
+  // Build bottom-up: winners move up, losers stay in tree[1..k)
+  for (node = k - 1; node >= 1; node--)
+    {
+      int l = 2 * node, r = 2 * node + 1;
+      int l_wins = head[l] <= head[r];
+      winner[node] = l_wins ? winner[l] : winner[r];
+      head[node] = l_wins ? head[l] : head[r];
+      tree[node] = l_wins ? winner[r] : winner[l];
+      key[node] = l_wins ? head[r] : head[l];
+    }
+
+  int w = winner[1];
+  long long wkey = head[1];
+  int t;
+  for (t = 0; t < total; t++)
+    {
+      out[t] = (int) wkey;
+      int *next = ++cur[w];
+      wkey = next < stop[w] ? *next : LLONG_MAX;
+      for (node = (w + k) >> 1; node >= 1; node >>= 1)
+	{
+	  int l = tree[node];
+	  long long lkey = key[node];
+	  int l_wins = lkey < wkey;
+	  tree[node] = l_wins ? w : l;
+	  key[node] = l_wins ? wkey : lkey;
+	  w = l_wins ? l : w;
+	  wkey = l_wins ? lkey : wkey;
+	}
+    }
+}
+
 void merge (int a[], int size, int temp[])
 {
   int i1 = 0;
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #if _POSIX_TIMERS
 #include <time.h>
@@ -42,9 +43,21 @@ double get_time(void)
 
 #define SMALL    32
 
+// Cache-aware multiway mode: sort blocks of CACHE_BLOCK keys (block plus
+// temp take half of a 2 MiB L2), then merge up to MERGE_WAYS runs per pass
+#define CACHE_BLOCK    (1 << 17)
+#define MERGE_WAYS     16
+
+// Set by -m: mergesort_serial switches to the multiway mode above CACHE_BLOCK
+int multiway_sort = 0;
+
 void merge (int a[], int size, int temp[]);
 void insertion_sort (int a[], int size);
 void mergesort_serial (int a[], int size, int temp[]);
+void mergesort_multiway (int a[], int size, int temp[]);
+void sort_block (int a[], int size, int temp[]);
+void merge_runs (int src[], int pos[], int end[], int ways, int out[]);
+unsigned long long key_hash (int key);
 extern double get_time (void);
 int main (int argc, char *argv[]);
 
@@ -52,9 +65,14 @@ int main (int argc, char *argv[])
 {
   puts ("-Serial Recursive Mergesort-\t");
 
+  if (argc == 3 && strcmp (argv[2], "-m") == 0)
+    {
+      multiway_sort = 1;
+      argc--;
+    }
   if (argc != 2)
     {
-      printf ("Usage: %s array-size\n", argv[0]);
+      printf ("Usage: %s array-size [-m]\n", argv[0]);
       return 1;
     }
   int size = atoi (argv[1]);
@@ -67,31 +85,56 @@ int main (int argc, char *argv[])
       return 1;
     }
    int i;
+  unsigned long long input_hash = 0, output_hash = 0;
   srand (314159);
   for (i = 0; i < size; i++)
     {
       a[i] = rand () % size;
+      input_hash += key_hash (a[i]);
     }
   double start = get_time ();
   mergesort_serial (a, size, temp);
   double end = get_time ();
   printf ("Start = %.2f\nEnd = %.2f\nElapsed = %.2f\n",
 	  start, end, end - start);
-  for (i = 1; i < size; i++)
+  // One pass checks order and that the output is a permutation of the input
+  for (i = 0; i < size; i++)
     {
-      if (!(a[i - 1] <= a[i]))
+      output_hash += key_hash (a[i]);
+      if (i > 0 && !(a[i - 1] <= a[i]))
 	{
 	  printf ("Implementation error: a[%d]=%d > a[%d]=%d\n", i - 1,a[i - 1], i, a[i]);
 	  return 1;
 	}
     }
+  if (output_hash != input_hash)
+    {
+      printf ("Implementation error: output is not a permutation of the input (hash %016llx, expected %016llx)\n",
+	      output_hash, input_hash);
+      return 1;
+    }
   puts ("-Success-");
   return 0;
 }
 
+// Order-independent multiset fingerprint: the sum of a 64-bit mix of each
+// key, so a lost, duplicated or altered key changes the total
+unsigned long long key_hash (int key)
+{
+  unsigned long long z = (unsigned int) key + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
 void
 mergesort_serial (int a[], int size, int temp[])
 {
+  if (multiway_sort && size > CACHE_BLOCK)
+    {
+      mergesort_multiway (a, size, temp);
+      return;
+    }
   if (size <= SMALL)
     {
       insertion_sort (a, size);
@@ -102,6 +145,127 @@ mergesort_serial (int a[], int size, int temp[])
   merge (a, size, temp);
 }
 
+// Cache-aware multiway mergesort.
+// Blocks of CACHE_BLOCK keys are sorted while they sit in cache; after that
+// each pass streams the array once, merging MERGE_WAYS runs through a loser
+// tree and ping-ponging between a and temp. That is log16 instead of log2
+// passes over DRAM, and no merge in this mode takes a data-dependent branch.
+void mergesort_multiway (int a[], int size, int temp[])
+{
+  int start, run = CACHE_BLOCK;
+  for (start = 0; start < size; start += run)
+    {
+      sort_block (a + start, size - start < run ? size - start : run,
+		  temp + start);
+    }
+  int *src = a, *dst = temp;
+  while (run < size)
+    {
+      long long group = (long long) run * MERGE_WAYS;
+      for (start = 0; start < size; start += group)
+	{
+	  int pos[MERGE_WAYS], end[MERGE_WAYS];
+	  int ways = 0, from = start;
+	  while (ways < MERGE_WAYS && from < size)
+	    {
+	      pos[ways] = from;
+	      from = size - from < run ? size : from + run;
+	      end[ways++] = from;
+	    }
+	  merge_runs (src, pos, end, ways, dst + start);
+	}
+      int *swap = src;
+      src = dst;
+      dst = swap;
+      run = group < size ? (int) group : size;
+    }
+  if (src != a)
+    memcpy (a, src, size * sizeof (int));
+}
+
+// Mergesort of one in-cache block. On random keys the branch in merge is
+// mispredicted about half the time, so the block merges pick the smaller
+// head with a mask instead.
+void sort_block (int a[], int size, int temp[])
+{
+  if (size <= SMALL)
+    {
+      insertion_sort (a, size);
+      return;
+    }
+  sort_block (a, size / 2, temp);
+  sort_block (a + size / 2, size - size / 2, temp);
+  int *l = a, *lend = a + size / 2, *r = lend, *rend = a + size, *o = temp;
+  while (l < lend && r < rend)
+    {
+      int x = *l, y = *r, take_r = y < x;
+      *o++ = x ^ ((x ^ y) & -take_r);
+      r += take_r;
+      l += !take_r;
+    }
+  while (l < lend)
+    *o++ = *l++;
+  while (r < rend)
+    *o++ = *r++;
+  memcpy (a, temp, size * sizeof (int));
+}
+
+// Merge src[pos[i]..end[i]) for i < ways into out with a loser tree:
+// tree[1..] holds the loser of each match and key[1..] its current head,
+// so replacing the winner replays one leaf-to-root path of log2(ways)
+// matches, each a compare and conditional moves against the winner's key
+// kept in a register. Keys are widened to 64 bits with LLONG_MAX for an
+// exhausted run.
+void merge_runs (int src[], int pos[], int end[], int ways, int out[])
+{
+  int tree[MERGE_WAYS], winner[2 * MERGE_WAYS];
+  long long key[MERGE_WAYS], head[2 * MERGE_WAYS];
+  int *cur[MERGE_WAYS], *stop[MERGE_WAYS];
+  int k = 1, i, node, total = 0;
+  while (k < ways)
+    k <<= 1;
+  for (i = 0; i < k; i++)
+    {
+      if (i >= ways)
+	pos[i] = end[i] = 0;
+      total += end[i] - pos[i];
+      cur[i] = src + pos[i];
+      stop[i] = src + end[i];
+      head[k + i] = pos[i] < end[i] ? src[pos[i]] : LLONG_MAX;
+      winner[k + i] = i;
+    }
+  // Build bottom-up: winners move up, losers stay in tree[1..k)
+  for (node = k - 1; node >= 1; node--)
+    {
+      int l = 2 * node, r = 2 * node + 1;
+      int l_wins = head[l] <= head[r];
+      winner[node] = l_wins ? winner[l] : winner[r];
+      head[node] = l_wins ? head[l] : head[r];
+      tree[node] = l_wins ? winner[r] : winner[l];
+      key[node] = l_wins ? head[r] : head[l];
+    }
+
+  int w = winner[1];
+  long long wkey = head[1];
+  int t;
+  for (t = 0; t < total; t++)
+    {
+      out[t] = (int) wkey;
+      int *next = ++cur[w];
+      wkey = next < stop[w] ? *next : LLONG_MAX;
+      for (node = (w + k) >> 1; node >= 1; node >>= 1)
+	{
+	  int l = tree[node];
+	  long long lkey = key[node];
+	  int l_wins = lkey < wkey;
+	  tree[node] = l_wins ? w : l;
+	  key[node] = l_wins ? wkey : lkey;
+	  w = l_wins ? l : w;
+	  wkey = l_wins ? lkey : wkey;
+	}
+    }
+}
+
 void merge (int a[], int size, int temp[])
 {
   int i1 = 0;